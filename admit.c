@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hddtemp.h"
+
+/* concurrent connections, 0 for no limit */
+int admit_max_conns = 0;
+/* requests per second and source address, 0 for no limit */
+int admit_rate = 0;
+/* backlog of the listen sockets */
+int admit_backlog = 127;
+
+/*
+ * Token bucket per source address.  The table is a fixed size hash,
+ * a new address simply takes over the slot of an old one, so memory
+ * stays constant however many sources show up.  Tokens are counted in
+ * thousandths, a request costs ADMIT_TOKEN and the bucket holds one
+ * second worth of requests.  Every accept loop has its own table, so
+ * none is shared between processes or threads.
+ */
+#define ADMIT_TABLE	1024
+#define ADMIT_TOKEN	1000
+
+struct admit_entry {
+	u_int8_t addr[16];
+	u_int64_t last;		/* stats_now() of the last refill */
+	u_int64_t tokens;
+};
+
+struct admit_table {
+	struct admit_entry entry[ADMIT_TABLE];
+};
+
+struct admit_table *
+admit_table_new(void)
+{
+	struct admit_table *t;
+
+	if ((t = calloc(1, sizeof(struct admit_table))) == NULL)
+		err(1, "calloc");
+	return t;
+}
+
+static int
+admit_source(struct sockaddr *sa, u_int8_t *addr)
+{
+	memset(addr, 0, 16);
+	switch (sa->sa_family) {
+	case AF_INET:
+		memcpy(addr, &((struct sockaddr_in *)sa)->sin_addr, 4);
+		return 0;
+	case AF_INET6:
+		memcpy(addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+		return 0;
+	default:
+		/* local sockets are not rate limited */
+		return -1;
+	}
+}
+
+static int
+admit_rate_ok(struct admit_table *t, struct sockaddr *sa)
+{
+	struct admit_entry *e;
+	u_int8_t addr[16];
+	u_int32_t h = 2166136261U;
+	u_int64_t now, burst;
+	int i;
+
+	if (admit_source(sa, addr) == -1)
+		return 1;
+
+	/* FNV-1a */
+	for (i = 0; i < 16; i++)
+		h = (h ^ addr[i]) * 16777619U;
+	e = &t->entry[h % ADMIT_TABLE];
+
+	now = stats_now();
+	burst = (u_int64_t)admit_rate * ADMIT_TOKEN;
+	if (e->last == 0 || memcmp(e->addr, addr, 16) != 0) {
+		memcpy(e->addr, addr, 16);
+		e->tokens = burst;
+	} else if (now - e->last >= 1000000)
+		e->tokens = burst;
+	else {
+		e->tokens += (now - e->last) * admit_rate * ADMIT_TOKEN /
+		    1000000;
+		if (e->tokens > burst)
+			e->tokens = burst;
+	}
+	e->last = now;
+
+	if (e->tokens < ADMIT_TOKEN)
+		return 0;
+	e->tokens -= ADMIT_TOKEN;
+	return 1;
+}
+
+/*
+ * decide what to do with a new connection from sa while inflight
+ * others are being served.
+ */
+int
+admit_check(struct admit_table *t, struct sockaddr *sa, int inflight)
+{
+	if (admit_max_conns && inflight >= admit_max_conns) {
+		STATS_ADD(hdd_stats->shed_busy, 1);
+		return ADMIT_BUSY;
+	}
+	if (admit_rate && !admit_rate_ok(t, sa)) {
+		STATS_ADD(hdd_stats->shed_rate, 1);
+		return ADMIT_RATE;
+	}
+	return ADMIT_OK;
+}
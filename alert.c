@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hddtemp.h"
+
+/*
+ * Temperature alerts, evaluated by the [priv] process each time it
+ * samples the devices.  A device goes up a level as soon as it reaches
+ * the threshold, and comes down only once it is alert_hyst degrees
+ * below, so a disk hovering around a threshold does not flap.  Every
+ * change is logged and written at once to the subscribers, connections
+ * which asked for "SUBSCRIBE" and were handed over to [priv].
+ */
+
+/* default thresholds in C, 0 for none; the db entry may override */
+int alert_warn = 0;
+int alert_crit = 0;
+int alert_hyst = 2;
+
+static int alert_subs[ALERT_MAXSUB];
+static int alert_nsubs = 0;
+
+static const char *alert_names[] = { "OK", "WARN", "CRIT" };
+
+/* the level temp reaches with the thresholds lowered by hyst */
+static int
+alert_level(int temp, int warn, int crit, int hyst)
+{
+	if (crit && temp >= crit - hyst)
+		return ALERT_CRIT;
+	if (warn && temp >= warn - hyst)
+		return ALERT_WARN;
+	return ALERT_NONE;
+}
+
+static void
+alert_send(const char *line, int len)
+{
+	int i;
+
+	for (i = 0; i < alert_nsubs; i++) {
+		if (write(alert_subs[i], line, len) == len)
+			continue;
+		/* gone or not reading, drop it */
+		close(alert_subs[i]);
+		alert_subs[i--] = alert_subs[--alert_nsubs];
+	}
+}
+
+void
+alert_check(struct hdd_device *dev)
+{
+	char line[128];
+	int warn, crit, up, down, level, len;
+
+	if (dev->status != 0)
+		return;
+	warn = dev->db && dev->db->warn ? dev->db->warn : alert_warn;
+	crit = dev->db && dev->db->crit ? dev->db->crit : alert_crit;
+	if (!warn && !crit)
+		return;
+
+	up = alert_level(dev->temp, warn, crit, 0);
+	down = alert_level(dev->temp, warn, crit, alert_hyst);
+	if (up > dev->alert)
+		level = up;
+	else if (down < dev->alert)
+		level = down;
+	else
+		return;
+	dev->alert = level;
+
+	syslog(level == ALERT_CRIT ? LOG_CRIT :
+	    level == ALERT_WARN ? LOG_WARNING : LOG_NOTICE,
+	    "%s: %s: %dC %s", dev->dev, dev->model, dev->temp,
+	    alert_names[level]);
+	STATS_ADD(hdd_stats->alerts, 1);
+
+	/* a reply record, then the level and the time of the sample */
+	len = snprintf(line, sizeof(line), "|%s|%s|%d|C|%s|%lld|\n",
+	    dev->dev, dev->model, dev->temp, alert_names[level],
+	    (long long)dev->sampled);
+	if (len > 0 && (size_t)len < sizeof(line))
+		alert_send(line, len);
+}
+
+/* take over a connection, returns -1 when there are too many */
+int
+alert_subscribe(int fd)
+{
+	static const char hello[] = "SUBSCRIBED\n";
+
+	if (alert_nsubs == ALERT_MAXSUB) {
+		close(fd);
+		return -1;
+	}
+	/* a subscriber never blocks [priv] */
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+	    write(fd, hello, sizeof(hello) - 1) != sizeof(hello) - 1) {
+		close(fd);
+		return -1;
+	}
+	alert_subs[alert_nsubs++] = fd;
+	return 0;
+}
+
+/* add the subscribers to the poll set of [priv] */
+int
+alert_pollfd(struct pollfd *pfd)
+{
+	int i;
+
+	for (i = 0; i < alert_nsubs; i++) {
+		pfd[i].fd = alert_subs[i];
+		pfd[i].events = POLLIN;
+		pfd[i].revents = 0;
+	}
+	return alert_nsubs;
+}
+
+/* close the subscribers which hung up, whatever they send is dropped */
+void
+alert_reap(struct pollfd *pfd, int n)
+{
+	char junk[64];
+	ssize_t r;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		if (pfd[i].revents == 0)
+			continue;
+		if ((pfd[i].revents & (POLLHUP | POLLERR | POLLNVAL)) == 0) {
+			r = recv(pfd[i].fd, junk, sizeof(junk), MSG_DONTWAIT);
+			if (r > 0 || (r == -1 && errno == EAGAIN))
+				continue;
+		}
+		for (j = 0; j < alert_nsubs; j++) {
+			if (alert_subs[j] != pfd[i].fd)
+				continue;
+			close(alert_subs[j]);
+			alert_subs[j] = alert_subs[--alert_nsubs];
+			break;
+		}
+	}
+}
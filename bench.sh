@@ -0,0 +1,119 @@
+#!/bin/sh
+#
+# Copyright (c) 2004 Iwata <iratqq@gmail.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# Connection rate of the accept modes.  For each of a fork per
+# connection, -P n and -T n the daemon is started on a replayed trace,
+# answering from the cache (-F), and p client processes each run
+# "hddtemp -C" rounds of c connections at once against it.  Prints
+# the connections per second of every mode.  Must run as root, like
+# the daemon, whose messages go to bench.err.
+#
+# usage: bench.sh [-c conns] [-n rounds] [-p clients] [-w n] [-x hddtemp]
+#	 trace [hddtemp option ...]
+#
+
+conns=50
+rounds=200
+clients=4
+n=4
+hddtemp=./hddtemp
+port=7634
+
+usage() {
+	echo "usage: bench.sh [-c conns] [-n rounds] [-p clients] [-w n]" \
+	    "[-x hddtemp]" >&2
+	echo "	trace [hddtemp option ...]" >&2
+	exit 1
+}
+
+while getopts c:n:p:w:x: ch; do
+	case $ch in
+	c)	conns=$OPTARG ;;
+	n)	rounds=$OPTARG ;;
+	p)	clients=$OPTARG ;;
+	w)	n=$OPTARG ;;
+	x)	hddtemp=$OPTARG ;;
+	*)	usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -ge 1 ] || usage
+trace=$1
+shift
+opts="$*"
+
+name=${hddtemp##*/}
+work=$(mktemp -d /tmp/bench.XXXXXXXX) || exit 1
+root=
+
+cleanup() {
+	[ -n "$root" ] && kill $root 2>/dev/null
+	rm -rf $work
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+i=0
+while [ $i -lt $conns ]; do
+	echo 127.0.0.1:$port
+	i=$((i + 1))
+done >$work/hosts
+
+# "mode conns/s" of one run of the daemon with the options given
+run() {
+	before=$(ps -A -o pid= -o comm= | awk -v n=$name '$2 == n { print $1 }')
+	$hddtemp -d -F 60 -R "$trace" -L 127.0.0.1:$port $opts "$@" </dev/null \
+	    >>bench.err 2>&1 || exit 1
+	sleep 2
+	root=$(ps -A -o pid= -o ppid= -o comm= | awk -v n=$name \
+	    -v old="$before" '
+		BEGIN { split(old, o); for (i in o) seen[o[i]] = 1 }
+		{ comm[$1] = $3; ppid[$1] = $2 }
+		END {
+			for (p in comm)
+				if (comm[p] == n && !(p in seen) &&
+				    comm[ppid[p]] != n)
+					print p
+		}')
+	# warm the cache
+	$hddtemp -C $work/hosts >/dev/null
+
+	start=$(date +%s)
+	i=0
+	while [ $i -lt $clients ]; do
+		(j=0
+		while [ $j -lt $rounds ]; do
+			$hddtemp -C $work/hosts >/dev/null 2>&1
+			j=$((j + 1))
+		done) &
+		i=$((i + 1))
+	done
+	wait
+	secs=$(($(date +%s) - start))
+	[ $secs -gt 0 ] || secs=1
+
+	kill $root
+	root=
+	sleep 2
+	echo "${*:-fork} $((clients * rounds * conns / secs))"
+}
+
+echo "mode conns/s"
+run
+run -P $n
+run -T $n
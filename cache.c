@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <string.h>
+
+#include "hddtemp.h"
+
+/*
+ * The last temperature reply, shared by every process of the daemon.
+ * Readers never block: the sequence number is odd while a writer is
+ * copying, and a reader which sees it change retries or gives up.  A
+ * writer which finds another one at work simply skips its update.
+ */
+struct hdd_cache {
+	volatile u_int32_t seq;
+	u_int64_t stamp;		/* stats_now() of the update */
+	int len;
+	char buf[HDDTEMP_REPLYMAX];
+};
+
+#define CACHE_RETRY 4
+
+static struct hdd_cache *hdd_cache;
+
+/* seconds a cached reply may be served to a shed connection */
+int cache_ttl = 60;
+/* seconds a cached reply may be served instead of asking [priv] */
+int cache_fresh = 0;
+
+void
+cache_init(void)
+{
+	void *p;
+
+	p = mmap(NULL, sizeof(struct hdd_cache), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap");
+	memset(p, 0, sizeof(struct hdd_cache));
+	hdd_cache = p;
+}
+
+void
+cache_store(const char *buf, int len)
+{
+	cache_import(buf, len, stats_now());
+}
+
+/* store a reply taken at stamp (stats_now()), as handed over */
+void
+cache_import(const char *buf, int len, u_int64_t stamp)
+{
+	u_int32_t seq;
+
+	if (hdd_cache == NULL || len <= 0 || len > HDDTEMP_REPLYMAX)
+		return;
+	seq = hdd_cache->seq;
+	if ((seq & 1) ||
+	    !__sync_bool_compare_and_swap(&hdd_cache->seq, seq, seq + 1))
+		return;
+	memcpy(hdd_cache->buf, buf, len);
+	hdd_cache->len = len;
+	hdd_cache->stamp = stamp;
+	__sync_synchronize();
+	hdd_cache->seq = seq + 2;
+}
+
+/* cache_export() without the stamp */
+int
+cache_load(char *buf, size_t len, int maxage)
+{
+	u_int64_t stamp;
+
+	return cache_export(buf, len, maxage, &stamp);
+}
+
+/*
+ * copy the cached reply if it is younger than maxage seconds, and
+ * when it was taken.  returns its length, or 0 if there is none.
+ */
+int
+cache_export(char *buf, size_t len, int maxage, u_int64_t *stampp)
+{
+	u_int32_t seq;
+	u_int64_t stamp;
+	int i, n;
+
+	if (hdd_cache == NULL)
+		return 0;
+	for (i = 0; i < CACHE_RETRY; i++) {
+		seq = hdd_cache->seq;
+		if (seq == 0 || (seq & 1))
+			continue;
+		__sync_synchronize();
+		n = hdd_cache->len;
+		stamp = hdd_cache->stamp;
+		if (n <= 0 || (size_t)n > len)
+			return 0;
+		memcpy(buf, hdd_cache->buf, n);
+		__sync_synchronize();
+		if (hdd_cache->seq != seq)
+			continue;
+		if (stats_now() - stamp > (u_int64_t)maxage * 1000000)
+			return 0;
+		*stampp = stamp;
+		return n;
+	}
+	return 0;
+}
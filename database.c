@@ -14,6 +14,9 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+
+#include <err.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,14 +37,124 @@ typedef enum {
 	DB_END
 } database_state;
 
-hdd_database*
-database_new()
+/*
+ * All storage of a parsed database comes from one arena, so that the
+ * whole list is released in one step once the entries needed by the
+ * devices are resolved.
+ */
+#define DBARENA_CHUNK	16384
+#define DBARENA_ALIGN(n) (((n) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+
+struct dbarena {
+	struct dbarena *next;
+	size_t used;
+	size_t size;
+};
+
+struct hdd_dbfile {
+	struct dbarena *arena;
+	hdd_database head;	/* list head, entries start at head.next */
+};
+
+static void *
+dbarena_alloc(struct dbarena **arenap, size_t len)
 {
-	hdd_database *db;
+	struct dbarena *a = *arenap;
+	size_t hlen = DBARENA_ALIGN(sizeof(struct dbarena));
+	void *p;
 
-	db = malloc(sizeof(hdd_database));
-	memset(db, 0, sizeof(hdd_database));
-	return db;
+	len = DBARENA_ALIGN(len);
+	if (a == NULL || a->size - a->used < len) {
+		size_t size = len > DBARENA_CHUNK ? len : DBARENA_CHUNK;
+
+		if ((a = malloc(hlen + size)) == NULL)
+			err(1, "dbarena_alloc");
+		a->next = *arenap;
+		a->used = 0;
+		a->size = size;
+		*arenap = a;
+	}
+	p = (char *)a + hlen + a->used;
+	a->used += len;
+	memset(p, 0, len);
+	return p;
+}
+
+static void
+dbarena_free(struct dbarena *a)
+{
+	struct dbarena *next;
+
+	for (; a; a = next) {
+		next = a->next;
+		free(a);
+	}
+}
+
+/*
+ * units are "C" or "F" in practice, keep one copy of each for the
+ * lifetime of the process instead of one per entry.
+ */
+#define DBUNITMAX	8
+
+static const char *
+database_intern_unit(const char *unit)
+{
+	static char *units[DBUNITMAX];
+	static int nunits;
+	int i;
+
+	for (i = 0; i < nunits; i++)
+		if (strcmp(units[i], unit) == 0)
+			return units[i];
+	if (nunits == DBUNITMAX)
+		return NULL;
+	if ((units[nunits] = strdup(unit)) == NULL)
+		err(1, "strdup");
+	return units[nunits++];
+}
+
+static hdd_database*
+database_new(struct hdd_dbfile *dbf)
+{
+	return dbarena_alloc(&dbf->arena, sizeof(hdd_database));
+}
+
+static char *
+database_strdup(struct hdd_dbfile *dbf, const char *buf, int buflen)
+{
+	char *s;
+
+	s = dbarena_alloc(&dbf->arena, buflen);
+	strlcpy(s, buf, buflen);
+	return s;
+}
+
+/*
+ * optional "warn crit" after the model.  Anything else there was
+ * ignored before thresholds existed, so it leaves the entry without
+ * thresholds rather than failing the parse.
+ */
+static int
+database_thresholds(hdd_database *db, char *buf)
+{
+	const char *errstr;
+	char *warn, *crit;
+	int w, c;
+
+	if ((warn = strtok(buf, " \t\r")) == NULL)
+		return 0;
+	if ((crit = strtok(NULL, " \t\r")) == NULL || strtok(NULL, " \t\r"))
+		return -1;
+	w = strtonum(warn, 0, 255, &errstr);
+	if (errstr)
+		return -1;
+	c = strtonum(crit, 0, 255, &errstr);
+	if (errstr)
+		return -1;
+	db->warn = w;
+	db->crit = c;
+	return 0;
 }
 
 /*
@@ -50,7 +163,8 @@ database_new()
  */
 static int
 dbparser_core(FILE *fp, char c, char *buf, int buflen,
-	      hdd_database *db, hdd_database *tmpdb, database_state state, int lineno)
+	      struct hdd_dbfile *dbf, hdd_database *db, hdd_database *tmpdb,
+	      database_state state, int lineno)
 {
 	const char *errstr;
 
@@ -66,17 +180,20 @@ dbparser_core(FILE *fp, char c, char *buf, int buflen,
 		switch (state) {
 		case DB_COMMENT:
 			/* reset comment */
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, tmpdb, DB_START, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_START, lineno);
 		case DB_START:
 			/* empty line */
 			memset(buf, 0, DBLINEBUFMAX);
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, tmpdb, DB_START, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_START, lineno);
 		case DB_END:
+			if (database_thresholds(tmpdb, buf) == -1)
+				fprintf(stderr, "%d: bad thresholds, ignored\n",
+				    lineno);
 			/* append one database entry */
 			db->next = tmpdb;
 			db = tmpdb;
 			memset(buf, 0, DBLINEBUFMAX);
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, database_new(), DB_START, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, database_new(dbf), DB_START, lineno);
 		default:
 			fprintf(stderr, "%d: unexpected end of line\n", lineno);
 			return 0;
@@ -84,14 +201,16 @@ dbparser_core(FILE *fp, char c, char *buf, int buflen,
 	case '#': /* comment */
 		switch (state) {
 		case DB_COMMENT:
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, tmpdb, DB_COMMENT, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_COMMENT, lineno);
 		case DB_START:
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, database_new(), DB_COMMENT, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_COMMENT, lineno);
 		case DB_MODEL_REGEXP:
 		case DB_MODEL:
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, database_new(), state, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, state, lineno);
 		case DB_END:
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, database_new(), DB_COMMENT, lineno);
+			/* trailing comment drops the entry, reuse its storage */
+			memset(tmpdb, 0, sizeof(hdd_database));
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_COMMENT, lineno);
 		default:
 			fprintf(stderr, "%d: unexpected comment\n", lineno);
 			return 0;
@@ -99,27 +218,25 @@ dbparser_core(FILE *fp, char c, char *buf, int buflen,
 	case '"': /* into string or out of string */
 		switch (state) {
 		case DB_COMMENT:
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, tmpdb, DB_COMMENT, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_COMMENT, lineno);
 		case DB_START:
 			memset(buf, 0, DBLINEBUFMAX);
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, tmpdb, DB_MODEL_REGEXP, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_MODEL_REGEXP, lineno);
 		case DB_MODEL_REGEXP:
 			buf[buflen] = c;
 			buflen++;
-			tmpdb->model_regexp = malloc(buflen);
-			strlcpy(tmpdb->model_regexp, buf, buflen);
+			tmpdb->model_regexp = database_strdup(dbf, buf, buflen);
 			memset(buf, 0, DBLINEBUFMAX);
-			return dbparser_core(fp, fgetc(fp), buf, buflen, db, tmpdb, DB_MODEL_REGEXP_SPC, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, buflen, dbf, db, tmpdb, DB_MODEL_REGEXP_SPC, lineno);
 		case DB_UNIT_SPC:
 			memset(buf, 0, DBLINEBUFMAX);
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, tmpdb, DB_MODEL, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_MODEL, lineno);
 		case DB_MODEL:
 			buf[buflen] = c;
 			buflen++;
-			tmpdb->model = malloc(buflen);
-			strlcpy(tmpdb->model, buf, buflen);
+			tmpdb->model = database_strdup(dbf, buf, buflen);
 			memset(buf, 0, DBLINEBUFMAX);
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, tmpdb, DB_END, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_END, lineno);
 		default:
 			fprintf(stderr, "%d: unexpected `\"'\n", lineno);
 			return 0;
@@ -128,89 +245,158 @@ dbparser_core(FILE *fp, char c, char *buf, int buflen,
 	case '\t': /* space, split token */
 		switch (state) {
 		case DB_COMMENT:
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, tmpdb, DB_COMMENT, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_COMMENT, lineno);
 		case DB_ID:
 			buflen++;
 			buf[buflen + 1] = 0;
-			tmpdb->id = strtonum(buf, 0, 256, &errstr);
+			tmpdb->id = strtonum(buf, 0, 255, &errstr);
 			if (errstr)
 				errx(1, "number of id is %s: %s", errstr, buf);
 			memset(buf, 0, DBLINEBUFMAX);
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, tmpdb, DB_ID_SPC, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_ID_SPC, lineno);
 		case DB_UNIT:
-			buflen++;
-			tmpdb->unit = malloc(buflen);
-			strlcpy(tmpdb->unit, buf, buflen);
+			if ((tmpdb->unit = database_intern_unit(buf)) == NULL) {
+				fprintf(stderr, "%d: too many units\n", lineno);
+				return 0;
+			}
 			memset(buf, 0, DBLINEBUFMAX);
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, tmpdb, DB_UNIT_SPC, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_UNIT_SPC, lineno);
 		default:
 			buf[buflen] = c;
 			buflen++;
-			return dbparser_core(fp, fgetc(fp), buf, buflen, db, tmpdb, state, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, buflen, dbf, db, tmpdb, state, lineno);
 		}
 	default:
 		switch (state) {
 		case DB_COMMENT:
-			return dbparser_core(fp, fgetc(fp), buf, 0, db, tmpdb, DB_COMMENT, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 0, dbf, db, tmpdb, DB_COMMENT, lineno);
 		case DB_MODEL_REGEXP_SPC:
 			memset(buf, 0, DBLINEBUFMAX);
 			buf[0] = c;
-			return dbparser_core(fp, fgetc(fp), buf, 1, db, tmpdb, DB_ID, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 1, dbf, db, tmpdb, DB_ID, lineno);
 		case DB_ID_SPC:
 			memset(buf, 0, DBLINEBUFMAX);
 			buf[0] = c;
-			return dbparser_core(fp, fgetc(fp), buf, 1, db, tmpdb, DB_UNIT, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, 1, dbf, db, tmpdb, DB_UNIT, lineno);
 		default:
 			buf[buflen] = c;
 			buflen++;
-			return dbparser_core(fp, fgetc(fp), buf, buflen, db, tmpdb, state, lineno);
+			return dbparser_core(fp, fgetc(fp), buf, buflen, dbf, db, tmpdb, state, lineno);
 		}
 	}
 }	
 
 /* simple wrapper */
 int
-dbparser(FILE *fp, hdd_database *db)
+dbparser(FILE *fp, struct hdd_dbfile *dbf)
 {
 	char dbbuf[DBLINEBUFMAX];
 
-	return dbparser_core(fp, fgetc(fp), dbbuf, 0, db, NULL, DB_START, 1);
+	return dbparser_core(fp, fgetc(fp), dbbuf, 0, dbf, &dbf->head,
+	    database_new(dbf), DB_START, 1);
+}
+
+/*
+ * parse the whole dbfile into one arena.
+ * entries are valid until database_close().
+ */
+struct hdd_dbfile *
+database_open(char *dbfile)
+{
+	FILE *fp;
+	struct hdd_dbfile *dbf;
+	struct dbarena *arena = NULL;
+
+	if ((fp = fopen(dbfile, "r")) == NULL)
+		return NULL;
+	dbf = dbarena_alloc(&arena, sizeof(struct hdd_dbfile));
+	dbf->arena = arena;
+	if (!dbparser(fp, dbf)) {
+		fclose(fp);
+		database_close(dbf);
+		return NULL;
+	}
+	fclose(fp);
+	return dbf;
+}
+
+void
+database_close(struct hdd_dbfile *dbf)
+{
+	if (dbf)
+		dbarena_free(dbf->arena);
 }
 
+/*
+ * copy one entry out of the arena into a single compact block,
+ * so that the arena can be released.  free it with database_free().
+ */
 static hdd_database*
-search_hdd_model_from_db(char *model, hdd_database *db)
+database_resolve(hdd_database *p)
+{
+	hdd_database *db;
+	size_t rlen, mlen;
+
+	rlen = strlen(p->model_regexp) + 1;
+	mlen = strlen(p->model) + 1;
+	if ((db = malloc(sizeof(hdd_database) + rlen + mlen)) == NULL)
+		return NULL;
+	db->next = NULL;
+	db->id = p->id ? p->id : SMART_TEMPERATURE; /* default value */
+	db->unit = p->unit;
+	db->warn = p->warn;
+	db->crit = p->crit;
+	db->model_regexp = (char *)(db + 1);
+	memcpy(db->model_regexp, p->model_regexp, rlen);
+	db->model = db->model_regexp + rlen;
+	memcpy(db->model, p->model, mlen);
+	return db;
+}
+
+void
+database_free(hdd_database *db)
+{
+	free(db);
+}
+
+/*
+ * a private entry made of fields saved earlier, as if it had been
+ * matched.  free it with database_free().
+ */
+hdd_database*
+database_entry(const char *regexp, const char *model, int id,
+    const char *unit, int warn, int crit)
+{
+	hdd_database tmp;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.model_regexp = (char *)regexp;
+	tmp.model = (char *)model;
+	tmp.id = id;
+	tmp.warn = warn;
+	tmp.crit = crit;
+	if ((tmp.unit = database_intern_unit(unit)) == NULL)
+		return NULL;
+	return database_resolve(&tmp);
+}
+
+/* return a private copy of the entry matching model */
+hdd_database*
+database_match(struct hdd_dbfile *dbf, char *model)
 {
 	hdd_database *p;
 	regex_t regex;
+	int match;
 
-	for (p = db->next; p->next; p = p->next) {
+	for (p = dbf->head.next; p; p = p->next) {
 		if (regcomp(&regex, p->model_regexp, REG_EXTENDED | REG_NOSUB) != 0) {
 			perror("regcomp");
 			return NULL;
 		}
-		if (regexec(&regex, model, 0, NULL, 0) == 0)
-			return p;
+		match = regexec(&regex, model, 0, NULL, 0);
 		regfree(&regex);
+		if (match == 0)
+			return database_resolve(p);
 	}
 	return NULL;
 }
-
-hdd_database*
-search_hdd_model(char *dbfile, char *model)
-{
-	FILE *fp;
-	
-	hdd_database *db;
-
-	db = database_new();
-	if ((fp = fopen(dbfile, "r")) == NULL)
-		return NULL;
-	if (!dbparser(fp, db))
-		return NULL;
-	db = search_hdd_model_from_db(model, db);
-	fclose(fp);
-	if (db && db->id == 0)
-		/* default value */
-		db->id = SMART_TEMPERATURE;
-	return db;
-}
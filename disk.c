@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/sysctl.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "hddtemp.h"
+
+/* monitored devices */
+struct hdd_device *hdd_devices;
+
+/* discovery, NULL when only the devices given by hand are used */
+const struct disk_enumerator *disk_enum;
+char *disk_enum_arg;
+/* seconds between rescans, 0 to rescan on SIGUSR1 only */
+int disk_rescan_interval;
+
+/*
+ * hw.disknames enumerator.
+ * the sysctl returns "wd0:duid,sd0:duid,cd0:" (or "wd0,sd0,cd0" on
+ * older systems); devices without disk semantics are skipped.
+ */
+static int
+disk_enum_sysctl_list(const char *arg, disk_enum_cb cb, void *ctx)
+{
+	int mib[2] = { CTL_HW, HW_DISKNAMES };
+	static const char *skip[] = { "cd", "fd", "rd", "vnd", NULL };
+	char *names, *p, *name, *duid;
+	size_t len;
+	int i;
+
+	if (sysctl(mib, 2, NULL, &len, NULL, 0) == -1)
+		return -1;
+	if ((names = malloc(len)) == NULL)
+		return -1;
+	if (sysctl(mib, 2, names, &len, NULL, 0) == -1) {
+		free(names);
+		return -1;
+	}
+
+	for (p = names; (name = strsep(&p, ",")) != NULL; ) {
+		if ((duid = strchr(name, ':')) != NULL)
+			*duid = '\0';
+		if (*name == '\0')
+			continue;
+		for (i = 0; skip[i]; i++)
+			if (strncmp(name, skip[i], strlen(skip[i])) == 0)
+				break;
+		if (skip[i] == NULL)
+			cb(name, ctx);
+	}
+	free(names);
+	return 0;
+}
+
+/*
+ * directory enumerator, every entry of arg is taken as a device.
+ * mainly for testing with a directory of stub devices.
+ */
+static int
+disk_enum_dir_list(const char *arg, disk_enum_cb cb, void *ctx)
+{
+	DIR *dirp;
+	struct dirent *dp;
+	char path[MAXPATHLEN];
+
+	if ((dirp = opendir(arg)) == NULL)
+		return -1;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", arg, dp->d_name);
+		cb(path, ctx);
+	}
+	closedir(dirp);
+	return 0;
+}
+
+const struct disk_enumerator disk_enum_sysctl = {
+	"sysctl", disk_enum_sysctl_list
+};
+const struct disk_enumerator disk_enum_dir = {
+	"dir", disk_enum_dir_list
+};
+
+static struct hdd_device *
+disk_new(char *name)
+{
+	struct hdd_device *dev;
+
+	if ((dev = calloc(1, sizeof(struct hdd_device))) == NULL)
+		err(1, "calloc");
+	if ((dev->dev = strdup(name)) == NULL)
+		err(1, "strdup");
+	dev->fd = -1;
+	dev->attr_slot = -1;
+	dev->stats_slot = stats_dev_attach(name);
+	return dev;
+}
+
+/*
+ * Open the device and identify it, leaving model NULL when it cannot
+ * be.  The database entry is resolved separately by disk_match(), so
+ * that all devices share one parse.  Only dev is touched, this runs
+ * under disk_parallel().
+ */
+static void
+disk_identify(struct hdd_device *dev)
+{
+	char *name = dev->dev;
+        char dvname_store[MAXPATHLEN];
+	int fd;
+
+	/* the trace answers for the device */
+	if (trace_replaying) {
+		dev->model = ata_model(dev);
+		return;
+	}
+
+        fd = opendisk(name, O_RDWR, dvname_store, sizeof(dvname_store), 0);
+        if (fd == -1 && errno == ENOENT)
+                /*
+                 * Device doesn't exist.  Probably trying to open
+                 * a device which doesn't use disk semantics for
+                 * device name.  Try again, specifying "cooked",
+                 * which leaves off the "r" in front of the device's
+                 * name.
+                 */
+                fd = opendisk(name, O_RDWR, dvname_store,
+                    sizeof(dvname_store), 1);
+        if (fd == -1) {
+		warn("%s", name);
+		return;
+	}
+
+	dev->fd = fd;
+	if ((dev->model = ata_model(dev)) == NULL) {
+		close(dev->fd);
+		dev->fd = -1;
+	}
+}
+
+struct disk_parallel_ctx {
+	pthread_mutex_t lock;
+	struct hdd_device *next;	/* first device nobody took yet */
+	void (*fn)(struct hdd_device *);
+};
+
+static void *
+disk_parallel_run(void *arg)
+{
+	struct disk_parallel_ctx *ctx = arg;
+	struct hdd_device *dev;
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		if ((dev = ctx->next) != NULL)
+			ctx->next = dev->next;
+		pthread_mutex_unlock(&ctx->lock);
+		if (dev == NULL)
+			return NULL;
+		ctx->fn(dev);
+	}
+}
+
+/*
+ * Call fn for every device of list on up to DISK_MAXTHREADS threads,
+ * so that a round over the disks takes about as long as the slowest
+ * one instead of the sum.  fn must touch nothing but its device.
+ */
+void
+disk_parallel(struct hdd_device *list, void (*fn)(struct hdd_device *))
+{
+	pthread_t threads[DISK_MAXTHREADS - 1];
+	struct disk_parallel_ctx ctx;
+	struct hdd_device *dev;
+	int i, n = 0;
+
+	for (dev = list; dev && n < DISK_MAXTHREADS; dev = dev->next)
+		n++;
+	pthread_mutex_init(&ctx.lock, NULL);
+	ctx.next = list;
+	ctx.fn = fn;
+	/* the calling thread is one of them */
+	for (i = 0; i < n - 1; i++)
+		if (pthread_create(&threads[i], NULL, disk_parallel_run,
+		    &ctx) != 0)
+			break;
+	disk_parallel_run(&ctx);
+	while (i-- > 0)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&ctx.lock);
+}
+
+/*
+ * Open and identify the devices given by hand, all at once, and append
+ * them to the device list.  Returns -1 if one of them cannot be; with
+ * keep set it is appended all the same, without a model.
+ */
+int
+disk_open_all(char **names, int n, int keep)
+{
+	struct hdd_device *list = NULL, **tail = &list, *dev;
+	int i, ret = 0;
+
+	for (i = 0; i < n; i++) {
+		dev = disk_new(names[i]);
+		dev->pinned = 1;
+		*tail = dev;
+		tail = &dev->next;
+	}
+	disk_parallel(list, disk_identify);
+	while ((dev = list) != NULL) {
+		list = dev->next;
+		if (dev->model == NULL) {
+			ret = -1;
+			if (!keep) {
+				disk_close(dev);
+				continue;
+			}
+		}
+		disk_add(dev);
+	}
+	return ret;
+}
+
+void
+disk_close(struct hdd_device *dev)
+{
+	if (dev->fd != -1)
+		close(dev->fd);
+	stats_dev_detach(dev->stats_slot);
+	database_free(dev->db);
+	sketch_free(dev);
+	free(dev->model);
+	free(dev->serial);
+	free(dev->dev);
+	free(dev);
+}
+
+/* append to the device list */
+void
+disk_add(struct hdd_device *dev)
+{
+	struct hdd_device **devp;
+
+	for (devp = &hdd_devices; *devp; devp = &(*devp)->next)
+		;
+	dev->next = NULL;
+	*devp = dev;
+}
+
+/*
+ * Resolve the database entries of the devices with one parse of the
+ * database.  With all set every device is matched again, otherwise only
+ * the ones without an entry.  A device keeps its old entry when the
+ * new database has none.  Returns the number of unmatched devices, or
+ * -1 when the database cannot be read.
+ */
+int
+disk_match(int all)
+{
+	struct hdd_dbfile *dbf;
+	struct hdd_device *dev;
+	hdd_database *db;
+	int unmatched = 0;
+
+	/* nothing to parse for when every entry came from the state file */
+	for (dev = hdd_devices; dev; dev = dev->next)
+		if (dev->model != NULL && (dev->db == NULL || all))
+			break;
+	if (dev == NULL)
+		return 0;
+
+	if ((dbf = database_open(hdd_dbfile)) == NULL) {
+		fprintf(stderr, "cannot read database: %s\n", hdd_dbfile);
+		return -1;
+	}
+	for (dev = hdd_devices; dev; dev = dev->next) {
+		if (dev->model == NULL || (dev->db && !all))
+			continue;
+		if ((db = database_match(dbf, dev->model)) != NULL) {
+			database_free(dev->db);
+			dev->db = db;
+		} else if (dev->db == NULL) {
+			fprintf(stderr, "cannot find from database: \"%s\"\n",
+			    dev->model);
+			unmatched++;
+		}
+	}
+	database_close(dbf);
+	return unmatched;
+}
+
+/*
+ * A number shared by the disks behind one controller, as far as the
+ * name tells: the master and slave wd(4) of an IDE channel share one,
+ * any other disk is taken to sit on a bus of its own.
+ */
+int
+disk_controller(const char *name)
+{
+	const char *p;
+	int key = 0, unit;
+
+	if ((p = strrchr(name, '/')) != NULL)
+		name = p + 1;
+	for (p = name; *p >= 'a' && *p <= 'z'; p++)
+		key = key * 31 + *p;
+	unit = atoi(p);
+	if (p - name == 2 && strncmp(name, "wd", 2) == 0)
+		unit /= 2;
+	return (key * 31 + unit) & INT_MAX;
+}
+
+struct disk_rescan_ctx {
+	struct hdd_device *found;	/* newly attached devices */
+	struct hdd_device **tail;
+	struct hdd_device *probes;	/* known names, identified again */
+	struct hdd_device **ptail;
+};
+
+static void
+disk_rescan_cb(const char *name, void *arg)
+{
+	struct disk_rescan_ctx *ctx = arg;
+	struct hdd_device *dev;
+
+	for (dev = hdd_devices; dev; dev = dev->next)
+		if (strcmp(dev->dev, name) == 0) {
+			dev->seen = 1;
+			/* another disk may sit under the name; no stats slot */
+			dev = disk_new((char *)name);
+			stats_dev_detach(dev->stats_slot);
+			dev->stats_slot = -1;
+			*ctx->ptail = dev;
+			ctx->ptail = &dev->next;
+			return;
+		}
+
+	/* identified once the enumeration is over */
+	dev = disk_new((char *)name);
+	dev->seen = 1;
+	*ctx->tail = dev;
+	ctx->tail = &dev->next;
+}
+
+/* whether probe is still the disk known as dev */
+static int
+disk_same(struct hdd_device *dev, struct hdd_device *probe)
+{
+	/* one that fails for now keeps what was known of it */
+	if (probe->model == NULL)
+		return 1;
+	if (dev->model == NULL || strcmp(dev->model, probe->model) != 0)
+		return 0;
+	if (dev->serial == NULL || probe->serial == NULL)
+		return dev->serial == probe->serial;
+	return strcmp(dev->serial, probe->serial) == 0;
+}
+
+/*
+ * Enumerate the disks again, attach the new ones and detach the ones
+ * which are gone.  A known name is identified again, and replaced when
+ * the model or serial changed (another disk) or it had no model yet.
+ * Devices given by hand are never detached.  Returns the number of
+ * changes or -1.
+ */
+int
+disk_rescan(void)
+{
+	struct disk_rescan_ctx ctx;
+	struct hdd_device *dev, *probe, **devp;
+	int changes = 0;
+
+	if (disk_enum == NULL)
+		return 0;
+
+	for (dev = hdd_devices; dev; dev = dev->next)
+		dev->seen = dev->pinned;
+
+	ctx.found = ctx.probes = NULL;
+	ctx.tail = &ctx.found;
+	ctx.ptail = &ctx.probes;
+	if (disk_enum->enumerate(disk_enum_arg, disk_rescan_cb, &ctx) == -1) {
+		warn("%s enumerator", disk_enum->name);
+		while ((dev = ctx.found) != NULL) {
+			ctx.found = dev->next;
+			disk_close(dev);
+		}
+		while ((dev = ctx.probes) != NULL) {
+			ctx.probes = dev->next;
+			disk_close(dev);
+		}
+		return -1;
+	}
+
+	/*
+	 * a device which cannot be identified stays in the list without
+	 * a model, and is tried again on the next rescan.
+	 */
+	*ctx.tail = ctx.probes;
+	disk_parallel(ctx.found, disk_identify);
+	*ctx.tail = NULL;
+
+	while ((probe = ctx.probes) != NULL) {
+		ctx.probes = probe->next;
+		for (devp = &hdd_devices; (dev = *devp) != NULL;
+		    devp = &dev->next)
+			if (strcmp(dev->dev, probe->dev) == 0)
+				break;
+		if (dev == NULL || disk_same(dev, probe)) {
+			disk_close(probe);
+			continue;
+		}
+		probe->next = dev->next;
+		probe->pinned = dev->pinned;
+		probe->seen = 1;
+		*devp = probe;
+		disk_close(dev);
+		probe->stats_slot = stats_dev_attach(probe->dev);
+		changes++;
+	}
+
+	for (devp = &hdd_devices; (dev = *devp) != NULL; ) {
+		if (dev->seen) {
+			devp = &dev->next;
+			continue;
+		}
+		*devp = dev->next;
+		disk_close(dev);
+		changes++;
+	}
+
+	while ((dev = ctx.found) != NULL) {
+		ctx.found = dev->next;
+		disk_add(dev);
+		changes++;
+	}
+
+	if (changes) {
+		state_apply();
+		disk_match(0);
+		state_save();
+	}
+	return changes;
+}
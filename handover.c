@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hddtemp.h"
+
+/*
+ * Restart without refusing a connection.  A daemon started with -k path
+ * listens there for its successor.  A new daemon given the same path
+ * connects first; the running one sends its listen sockets and the
+ * cached reply, and once the new one has them it stops accepting,
+ * lets the connections in flight finish and exits.  The socket is
+ * made by root before the chroot and only root may take over.
+ *
+ * The old daemon sends a struct handover_msg with the sockets as
+ * SCM_RIGHTS, then cachelen bytes of reply; the new one answers with
+ * one byte once it holds them.
+ */
+struct handover_msg {
+	u_int32_t nsocks;
+	u_int32_t cachelen;
+	u_int64_t cacheage;	/* microseconds */
+};
+
+#define HANDOVER_TIMEOUT	5	/* seconds */
+
+/* path of the handover socket, NULL for none */
+char *handover_path = NULL;
+
+static void
+handover_timeout(int s)
+{
+	struct timeval tv;
+
+	tv.tv_sec = HANDOVER_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int
+handover_io(int s, void *buf, size_t n, int out)
+{
+	char *p = buf;
+	ssize_t r;
+
+	while (n > 0) {
+		r = out ? write(s, p, n) : read(s, p, n);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+/*
+ * Take the listen sockets of a running daemon into socks, up to max.
+ * Returns their number, 0 when no daemon is there to hand over, or -1.
+ */
+int
+handover_take(int *socks, int max)
+{
+	struct sockaddr_un sun;
+	struct handover_msg msg;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(MAX_LISTEN_SOCKS * sizeof(int))];
+	} cmsgbuf;
+	char buf[HDDTEMP_REPLYMAX];
+	int s, i, n = 0;
+	u_char ack = 1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, handover_path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		warnx("%s: path too long", handover_path);
+		return -1;
+	}
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		warn("socket");
+		return -1;
+	}
+	if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		close(s);
+		/* nobody there, or a stale socket */
+		if (errno == ENOENT || errno == ECONNREFUSED)
+			return 0;
+		warn("%s", handover_path);
+		return -1;
+	}
+	handover_timeout(s);
+
+	memset(&mh, 0, sizeof(mh));
+	memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = &cmsgbuf.buf;
+	mh.msg_controllen = sizeof(cmsgbuf.buf);
+	if (recvmsg(s, &mh, 0) != sizeof(msg) ||
+	    (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		warnx("%s: no handover", handover_path);
+		goto fail;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (n > max) {
+			for (i = 0; i < n; i++)
+				close(((int *)CMSG_DATA(cmsg))[i]);
+			n = 0;
+			break;
+		}
+		memcpy(socks, CMSG_DATA(cmsg), n * sizeof(int));
+		break;
+	}
+	if (n == 0 || n != (int)msg.nsocks) {
+		warnx("%s: bad handover", handover_path);
+		goto fail;
+	}
+
+	/* the reply is a bonus, a short one only costs a first sample */
+	if (msg.cachelen > 0 && msg.cachelen <= sizeof(buf) &&
+	    handover_io(s, buf, msg.cachelen, 0) == 0)
+		cache_import(buf, msg.cachelen, stats_now() - msg.cacheage);
+
+	/* from now on the old daemon stops accepting */
+	if (handover_io(s, &ack, 1, 1) == -1) {
+		warn("%s", handover_path);
+		goto fail;
+	}
+	close(s);
+	return n;
+
+ fail:
+	for (i = 0; i < n; i++)
+		close(socks[i]);
+	close(s);
+	return -1;
+}
+
+/*
+ * A successor connected to hsock: send it the n listen sockets of socks
+ * and the cached reply.  Returns 0 once it confirmed it holds them, -1
+ * when this daemon has to go on serving.
+ */
+int
+handover_give(int hsock, int *socks, int n)
+{
+	struct handover_msg msg;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(MAX_LISTEN_SOCKS * sizeof(int))];
+	} cmsgbuf;
+	char buf[HDDTEMP_REPLYMAX];
+	u_int64_t stamp;
+	uid_t uid;
+	gid_t gid;
+	int s;
+	u_char ack;
+
+	if ((s = accept(hsock, NULL, NULL)) == -1)
+		return -1;
+	if (getpeereid(s, &uid, &gid) == -1 || uid != 0 || n <= 0 ||
+	    n > MAX_LISTEN_SOCKS) {
+		close(s);
+		return -1;
+	}
+	handover_timeout(s);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nsocks = n;
+	if ((msg.cachelen = cache_export(buf, sizeof(buf), cache_ttl,
+	    &stamp)) > 0)
+		msg.cacheage = stats_now() - stamp;
+
+	memset(&mh, 0, sizeof(mh));
+	memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = &cmsgbuf.buf;
+	mh.msg_controllen = CMSG_SPACE(n * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cmsg), socks, n * sizeof(int));
+
+	if (sendmsg(s, &mh, 0) != sizeof(msg) ||
+	    (msg.cachelen && handover_io(s, buf, msg.cachelen, 1) == -1) ||
+	    handover_io(s, &ack, 1, 0) == -1) {
+		fprintf(stderr, "handover failed: %s\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+	close(s);
+	return 0;
+}
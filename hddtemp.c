@@ -27,8 +27,14 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <syslog.h>
+#include <time.h>
 #include <sys/wait.h>
 
 #include <dev/ata/atareg.h>
@@ -36,18 +42,13 @@
 #include <dev/ic/wdcevent.h>
 #include <sys/ataio.h>
 
+#include <endian.h>
 #include <getopt.h>
 
 #include "hddtemp.h"
 
-/* hdd device */
-int hdd_fd;
-/* hdd devname */
-char *hdd_dev;
-/* hdd model */
-char *hdd_model;
-/* database */
-hdd_database *hdd_db;
+/* database file, kept for reloading on SIGHUP */
+char *hdd_dbfile;
 
 /*-
  * Copyright (c) 1998 The NetBSD Foundation, Inc.
@@ -84,37 +85,62 @@ hdd_database *hdd_db;
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
-void
-ata_command(struct atareq *req)
+/*
+ * A failing device must not take the daemon down with it, so errors
+ * are reported and returned instead of exiting.
+ */
+int
+ata_command(struct hdd_device *dev, struct atareq *req)
 {
         int error;
-
-        if ((error = ioctl(hdd_fd, ATAIOCCOMMAND, req)) == -1)
-                err(1, "ATAIOCCOMMAND failed");
+	u_int64_t start, elapsed;
+
+	start = stats_now();
+	if (trace_replaying)
+		error = trace_replay(dev, req);
+	else
+		error = ioctl(dev->fd, ATAIOCCOMMAND, req);
+	elapsed = stats_now() - start;
+	if (dev->stats_slot != -1)
+		stats_hist_add(&hdd_stats->dev[dev->stats_slot].ioctl,
+		    elapsed);
+	if (trace_file && !trace_replaying)
+		trace_record(dev, req, error == -1 ? errno : 0, elapsed);
+        if (error == -1) {
+		STATS_ADD(hdd_stats->ioctl_errors, 1);
+                warn("ATAIOCCOMMAND failed");
+		return -1;
+	}
 
         switch (req->retsts) {
 
         case ATACMD_OK:
-                return;
+                return 0;
         case ATACMD_TIMEOUT:
-                errx(1, "ATA command timed out");
+                warnx("ATA command timed out");
+		break;
         case ATACMD_DF:
-                errx(1, "ATA device returned a Device Fault");
+                warnx("ATA device returned a Device Fault");
+		break;
         case ATACMD_ERROR:
                 if (req->error & WDCE_ABRT)
-                        errx(1, "ATA device returned Aborted Command");
+                        warnx("ATA device returned Aborted Command");
                 else
-                        errx(1, "ATA device returned error register %0x",
+                        warnx("ATA device returned error register %0x",
                             req->error);
+		break;
         default:
-		errx(1, "ATAIOCCOMMAND returned unknown result code %d",
+		warnx("ATAIOCCOMMAND returned unknown result code %d",
 		     req->retsts);
+		break;
         }
+	STATS_ADD(hdd_stats->ioctl_errors, 1);
+	return -1;
 }
 
 
 char *
-ata_model()
+ata_model(struct hdd_device *dev)
 {
 	struct ataparams *inqbuf;
         struct atareq req;
@@ -131,7 +157,8 @@ ata_model()
         req.datalen = sizeof(inbuf);
         req.timeout = 1000;
 	
-	ata_command(&req);
+	if (ata_command(dev, &req) == -1)
+		return NULL;
 
         if (BYTE_ORDER == BIG_ENDIAN) {
                 swap16_multi((u_int16_t *)inbuf, 10);
@@ -158,12 +185,27 @@ ata_model()
 	for (s = &inqbuf->atap_model[sizeof(inqbuf->atap_model) - 1];
 	     s >= (char *)inqbuf->atap_model && *s == ' '; s--)
                 *s = '\0';
-	s = strdup(inqbuf->atap_model);
+	/* the serial identifies the disk in the state file */
+	for (s = &inqbuf->atap_serial[sizeof(inqbuf->atap_serial) - 1];
+	     s >= (char *)inqbuf->atap_serial && *s == ' '; s--)
+                *s = '\0';
+	for (s = inqbuf->atap_serial; *s == ' '; s++)
+		;
+	free(dev->serial);
+	dev->serial = strndup(s, sizeof(inqbuf->atap_serial) -
+	    (s - (char *)inqbuf->atap_serial));
+
+	/* the fields are not NUL terminated when full */
+	s = strndup(inqbuf->atap_model, sizeof(inqbuf->atap_model));
 	return s;
 }
 
+/*
+ * raw temperature of dev in the unit of its database entry,
+ * INT_MAX if the attribute is missing, -1 on error.
+ */
 int
-smart_temperature()
+smart_temperature(struct hdd_device *dev)
 {
 	struct atareq req;
 	struct smart_read attr_val;
@@ -172,7 +214,7 @@ smart_temperature()
         struct threshold *thr;
 	int i;
 
-	if (hdd_db == NULL)
+	if (dev->db == NULL)
 		return 0;
 
 	memset(&req, 0, sizeof(req));
@@ -187,46 +229,228 @@ smart_temperature()
         req.flags = ATACMD_READ;
         req.databuf = (caddr_t)&attr_val;
         req.datalen = sizeof(attr_val);
-        ata_command(&req);
+        if (ata_command(dev, &req) == -1)
+		return -1;
+
+	/* the slot found last time saves reading the thresholds */
+	attr = attr_val.attribute;
+	if (dev->attr_slot >= 0 && attr[dev->attr_slot].id == dev->db->id)
+		return attr[dev->attr_slot].value;
 
         req.features = ATA_SMART_THRESHOLD;
         req.flags = ATACMD_READ;
         req.databuf = (caddr_t)&attr_thr;
         req.datalen = sizeof(attr_thr);
-        ata_command(&req);
+        if (ata_command(dev, &req) == -1)
+		return -1;
 
-        attr = attr_val.attribute;
         thr = attr_thr.threshold;
 
         for (i = 0; i < 30; i++) {
-		if (thr[i].id == hdd_db->id) {
+		if (thr[i].id == dev->db->id) {
+			dev->attr_slot = i;
+			state_dirty = 1;
 			return attr[i].value;
 		}
         }
 	return INT_MAX;
 }
 
+/* temperature of dev as reported by hddtemp */
+int
+device_temperature(struct hdd_device *dev)
+{
+	int temp;
+
+	temp = smart_temperature(dev);
+	if (temp < 0 || temp == INT_MAX)
+		return temp;
+
+	if (strcmp(dev->db->unit, "C") == 0)
+		temp = ftoc(temp);
+	return temp;
+}
+
 extern const char *__progname;		/* from crt0.o */
 
 void
 usage()
 {
-	fprintf(stderr, "%s [-d] [-f database] device\n", __progname);
+	fprintf(stderr, "%s [-ad] [-A directory] [-b backlog] [-C hosts] "
+	    "[-c conns] [-F age]\n\t[-f database] [-H degrees] "
+	    "[-i interval] [-j helpers] [-k path]\n\t[-L [host]:port] "
+	    "[-l rate] [-m mode] [-n interval]\n\t[-o text | json | csv] "
+	    "[-P workers | -T threads] [-p upstreams]\n\t[-q msec] "
+	    "[-R trace | -r trace] [-S statefile] [-s interval] [-t ttl]\n\t"
+	    "[-u path] [-W warn] [-w interval [-O]] [-X crit] [-x msec]\n\t"
+	    "[device ...]\n", __progname);
 	exit(1);
 }
 
+/*
+ * Milliseconds a connection child waits for a query before it sends
+ * the temperatures; 0 never reads from the client.
+ */
+int query_wait = 0;
+#define QUERYMAX 64
+
+/*
+ * Read the query of a client, if any, and build the reply.  A client
+ * which sends nothing gets the temperatures, as it always did.
+ */
+static int
+client_query(int sock, char *buf, size_t len)
+{
+	struct pollfd pfd;
+	char query[QUERYMAX];
+	ssize_t n, qlen = 0;
+	u_int64_t start;
+	u_int32_t gen = 0;
+	const char *errstr;
+
+	query[0] = '\0';
+	if (query_wait > 0) {
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, query_wait) == 1 &&
+		    (qlen = read(sock, query, sizeof(query) - 1)) > 0)
+			query[qlen] = '\0';
+	}
+
+	/* binary, the table generation follows its own query byte */
+	if ((qlen > 0 && query[0] == HDDTEMP_BIN_QUERY &&
+	    (qlen == 1 || query[1] == '\r' || query[1] == '\n')) ||
+	    (qlen == 1 + (ssize_t)sizeof(gen) &&
+	    (u_int8_t)query[0] == HDDTEMP_BIN_QUERY_GEN)) {
+		/* a proxy has no table of its own, it just closes */
+		if (proxy_list) {
+			STATS_ADD(hdd_stats->errors, 1);
+			return 0;
+		}
+		if ((u_int8_t)query[0] == HDDTEMP_BIN_QUERY_GEN) {
+			memcpy(&gen, query + 1, sizeof(gen));
+			gen = letoh32(gen);
+		}
+		STATS_ADD(hdd_stats->binary_requests, 1);
+		start = stats_now();
+		n = priv_request(PRIV_BINARY, gen, buf, len);
+		stats_hist_add(&hdd_stats->privsep_rtt, stats_now() - start);
+		return n;
+	}
+	query[strcspn(query, "\r\n")] = '\0';
+
+	if (strcmp(query, "STATS") == 0) {
+		STATS_ADD(hdd_stats->stats_requests, 1);
+		return stats_render(buf, len);
+	}
+
+	/* moving averages and quantiles of the -s samples */
+	if (strcmp(query, "SUMMARY") == 0 && !proxy_list) {
+		STATS_ADD(hdd_stats->requests, 1);
+		return priv_request(PRIV_SUMMARY, 0, buf, len);
+	}
+
+	/* "SINCE gen": the reply is prefixed with its generation */
+	if (strncmp(query, "SINCE ", 6) == 0 && !proxy_list) {
+		gen = strtonum(query + 6, 0, UINT32_MAX, &errstr);
+		if (errstr)
+			return snprintf(buf, len, "BAD\n");
+		STATS_ADD(hdd_stats->requests, 1);
+		start = stats_now();
+		n = priv_request(PRIV_SINCE, gen, buf, len);
+		stats_hist_add(&hdd_stats->privsep_rtt, stats_now() - start);
+		if (n > 0 && strncmp(buf, "NOTMODIFIED", 11) == 0)
+			STATS_ADD(hdd_stats->not_modified, 1);
+		return n;
+	}
+
+	/* [priv] greets the subscriber and writes the alerts itself */
+	if (strcmp(query, "SUBSCRIBE") == 0 && !proxy_list) {
+		if (priv_subscribe(sock) == -1)
+			return snprintf(buf, len, "BUSY\n");
+		return 0;
+	}
+
+	STATS_ADD(hdd_stats->requests, 1);
+	/* a proxy only has what its poller merged */
+	if (proxy_list) {
+		if ((n = cache_load(buf, len, cache_ttl)) > 0)
+			STATS_ADD(hdd_stats->cached, 1);
+		return n;
+	}
+	if (cache_fresh && (n = cache_load(buf, len, cache_fresh)) > 0) {
+		STATS_ADD(hdd_stats->cached, 1);
+		return n;
+	}
+
+	/* pass to priv server */
+	start = stats_now();
+	n = priv_request(PRIV_TEMPERATURE, 0, buf, len);
+	stats_hist_add(&hdd_stats->privsep_rtt, stats_now() - start);
+	cache_store(buf, n);
+	return n;
+}
+
+/*
+ * A connection over the limits gets no new work: the cached reply if
+ * there is a recent one, else it is just closed.  The socket is not
+ * waited on, a slow client only loses its answer and a reset one
+ * must not raise SIGPIPE in the listener.
+ */
+static void
+client_shed(int sock)
+{
+	char buf[HDDTEMP_REPLYMAX];
+	int len;
+
+	if ((len = cache_load(buf, sizeof(buf), cache_ttl)) > 0 &&
+	    send(sock, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) > 0)
+		STATS_ADD(hdd_stats->cache_hits, 1);
+	else
+		STATS_ADD(hdd_stats->rejected, 1);
+	close(sock);
+}
+
 /*
  * The sockets that the server is listening; this is used in the SIGHUP
  * signal handler.
  */
-#define MAX_LISTEN_SOCKS 16
 int listen_socks[MAX_LISTEN_SOCKS];
 int num_listen_socks = 0;
 
+/* connection children (or workers) alive */
+volatile sig_atomic_t num_children = 0;
+
+/* address to listen on, NULL host for any */
+char *listen_host = DEFAULT_HOST;
+char *listen_port = DEFAULT_PORT;
+
+/* poller of the proxy mode, not counted in num_children */
+static pid_t proxy_pid = -1;
+
+/* long-lived workers of the pre-fork mode, 0 forks per connection */
+int prefork_workers = 0;
+
+/* local listener, NULL for none */
+char *unix_listen_path = NULL;
+mode_t unix_listen_mode = 0666;
+
+/* listener of a successor, -1 for none; see handover.c */
+static int handover_sock = -1;
+/*
+ * closed by the pre-fork listener to send its workers away, on a
+ * handover or by its death
+ */
+static int handover_pipe[2] = { -1, -1 };
+
+/* acceptor threads, 0 for the single accept loop */
+int acceptor_threads = 0;
+static struct acceptor *acceptors;
+
 /*
  * Close all listening sockets
  */
-static void
+void
 close_listen_socks(void)
 {
         int i;
@@ -234,6 +458,37 @@ close_listen_socks(void)
         for (i = 0; i < num_listen_socks; i++)
                 close(listen_socks[i]);
         num_listen_socks = -1;
+	if (handover_sock != -1) {
+		close(handover_sock);
+		handover_sock = -1;
+	}
+}
+
+/*
+ * The listen sockets now belong to a new daemon.  Stop accepting, let
+ * the connections in flight (or the workers) finish and exit, which
+ * ends [priv] as well.
+ */
+static void
+client_drain(void)
+{
+	sigset_t mask, omask;
+
+	setproctitle("%s", "[draining]");
+	close_listen_socks();
+	/* workers see the end of the pipe and leave */
+	if (handover_pipe[1] != -1)
+		close(handover_pipe[1]);
+	if (proxy_pid != -1)
+		kill(proxy_pid, SIGTERM);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &omask);
+	sigdelset(&omask, SIGCHLD);
+	while (num_children > 0)
+		sigsuspend(&omask);
+	exit(HANDOVER_EXIT);
 }
 
 /*
@@ -250,12 +505,308 @@ main_sigchld_handler(int sig)
 
         while ((pid = waitpid(-1, &status, WNOHANG)) > 0 ||
             (pid < 0 && errno == EINTR))
-                ;
+		if (pid > 0 && pid != proxy_pid) {
+			num_children--;
+			STATS_ADD(hdd_stats->reaped, 1);
+		}
 
         signal(SIGCHLD, main_sigchld_handler);
         errno = save_errno;
 }
 
+/*
+ * Answer one connection and close it.
+ */
+static void
+client_serve(int sock, u_int64_t accepted)
+{
+	char buf[HDDTEMP_REPLYMAX];
+	int readlen;
+
+	memset(buf, 0, sizeof(buf));
+	readlen = client_query(sock, buf, sizeof(buf));
+	/* revieve to client */
+	if (readlen < 0) {
+		STATS_ADD(hdd_stats->errors, 1);
+		fprintf(stderr, "read: %.100s\n", strerror(errno));
+	} else if (write(sock, buf, readlen) != readlen)
+		STATS_ADD(hdd_stats->errors, 1);
+	stats_hist_add(&hdd_stats->service, stats_now() - accepted);
+
+	close(sock);
+}
+
+/*
+ * Pre-fork mode.  The listener keeps prefork_workers long-lived
+ * children, each accepting on the shared listen sockets and serving
+ * many connections, so no fork is on the path of a request.  A dead
+ * worker is reaped by main_sigchld_handler() and spawned again here.
+ * Returns 1 in a worker; the listener itself never returns.
+ */
+static int
+client_prefork(void)
+{
+	sigset_t mask, omask;
+	fd_set fds;
+	pid_t pid;
+	int i;
+
+	/* workers race for connections, a loser must not block */
+	for (i = 0; i < num_listen_socks; i++)
+		if (fcntl(listen_socks[i], F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+	if (pipe(handover_pipe) == -1)
+		err(1, "pipe");
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &omask);
+	setproctitle("%s", "[listener]");
+
+	for (;;) {
+		hdd_stats->children = num_children;
+		stats_proc_update(&hdd_stats->listener);
+		while (num_children < prefork_workers) {
+			if ((pid = fork()) == 0) {
+				sigprocmask(SIG_SETMASK, &omask, NULL);
+				signal(SIGCHLD, SIG_DFL);
+				if (handover_sock != -1) {
+					close(handover_sock);
+					handover_sock = -1;
+				}
+				close(handover_pipe[1]);
+				handover_pipe[1] = -1;
+				setproctitle("%s", "[worker]");
+				return 1;
+			}
+			if (pid < 0) {
+				STATS_ADD(hdd_stats->fork_errors, 1);
+				fprintf(stderr, "fork: %.100s\n",
+				    strerror(errno));
+				break;
+			}
+			num_children++;
+			STATS_ADD(hdd_stats->forks, 1);
+		}
+		/* sleep until a worker dies (or retry a failed fork) */
+		if (num_children < prefork_workers) {
+			sigprocmask(SIG_SETMASK, &omask, NULL);
+			sleep(1);
+			sigprocmask(SIG_BLOCK, &mask, NULL);
+		} else if (handover_sock == -1)
+			sigsuspend(&omask);
+		else {
+			/* or until a successor asks for the sockets */
+			FD_ZERO(&fds);
+			FD_SET(handover_sock, &fds);
+			if (pselect(handover_sock + 1, &fds, NULL, NULL, NULL,
+			    &omask) == 1 && handover_give(handover_sock,
+			    listen_socks, num_listen_socks) == 0)
+				client_drain();
+		}
+	}
+}
+
+/*
+ * Bind and listen on every address of res, appending the sockets to
+ * socks which already holds n of them.  Returns the new count.
+ */
+static int
+listen_bind(struct addrinfo *res, int *socks, int n)
+{
+	struct sockaddr *sa;
+	int listen_sock;
+	u_int8_t salen;
+	char ntop[NI_MAXHOST], strport[NI_MAXSERV];
+	int on = 1;
+
+	for ( ; res; res = res->ai_next) {
+		sa = res->ai_addr;
+		salen = res->ai_addrlen;
+
+		if (res->ai_family != AF_INET && res->ai_family != AF_INET6)
+			continue;
+
+		if (n >= MAX_LISTEN_SOCKS) {
+			fprintf(stderr,
+				"Too many listen sockets. "
+				"Enlarge MAX_LISTEN_SOCKS\n");
+			exit(1);
+		}
+		if (getnameinfo(sa, salen,
+				ntop, sizeof(ntop), strport, sizeof(strport),
+				NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
+			fprintf(stderr, "getnameinfo failed\n");
+			continue;
+		}
+		/* Create socket for listening. */
+		listen_sock = socket(res->ai_family, res->ai_socktype,
+				     res->ai_protocol);
+		if (listen_sock < 0) {
+			/* kernel may not support ipv6 */
+			fprintf(stderr, "socket: %.100s\n", strerror(errno));
+			continue;
+		}
+
+		/*
+		 * Set socket options.
+		 * Allow local port reuse in TIME_WAIT.
+		 */
+		if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR,
+			       &on, sizeof(on)) == -1)
+			fprintf(stderr, "setsockopt SO_REUSEADDR: %s\n", strerror(errno));
+
+		if (bind(listen_sock, sa, salen) < 0) {
+			fprintf(stderr, "Bind to port %s on %s failed: %.200s.\n",
+				strport, ntop, strerror(errno));
+			close(listen_sock);
+			continue;
+		}
+		socks[n++] = listen_sock;
+
+		/* Start listening on the port. */
+#if 0
+		printf("Server listening on %s port %s.\n", ntop, strport);
+#endif
+		if (listen(listen_sock, admit_backlog) < 0) {
+			fprintf(stderr, "listen: %.100s\n", strerror(errno));
+			exit(1);
+		}
+	}
+
+	return n;
+}
+
+/*
+ * The AF_UNIX listener for local collectors.  It is made before the
+ * privileges are dropped, since the path is outside of the chroot, and
+ * is then served like any TCP socket.
+ */
+static int
+listen_unix(const char *path, mode_t mode)
+{
+	struct sockaddr_un sun;
+	mode_t omask;
+	int s;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		errx(1, "%s: path too long", path);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (unlink(path) == -1 && errno != ENOENT)
+		err(1, "unlink %s", path);
+	omask = umask(0177);
+	if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "bind %s", path);
+	umask(omask);
+	if (chmod(path, mode) == -1)
+		err(1, "chmod %s", path);
+	if (listen(s, admit_backlog) == -1)
+		err(1, "listen %s", path);
+	return s;
+}
+
+/*
+ * Acceptor threads.  They all poll the same listen sockets, made
+ * non-blocking as for the pre-fork workers, so the one that wins the
+ * accept() serves the connection and the others go back to sleep.
+ * Each has its own rate table.  Answers come from the shared cache;
+ * the read path takes no lock and only a miss goes to the [priv]
+ * process.
+ */
+struct acceptor {
+	pthread_t thread;
+	struct admit_table *admit;
+};
+
+static void *
+client_acceptor(void *arg)
+{
+	struct acceptor *a = arg;
+	struct pollfd pfd[MAX_LISTEN_SOCKS];
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	u_int64_t accepted;
+	time_t gauged = 0;
+	int i, newsock;
+
+	for (i = 0; i < num_listen_socks; i++) {
+		pfd[i].fd = listen_socks[i];
+		pfd[i].events = POLLIN;
+	}
+
+	for (;;) {
+		/* the gauges are the process's, one thread now and then */
+		if (a == &acceptors[0] && time(NULL) != gauged) {
+			gauged = time(NULL);
+			stats_proc_update(&hdd_stats->listener);
+		}
+		if (poll(pfd, num_listen_socks, INFTIM) == -1) {
+			if (errno != EINTR)
+				fprintf(stderr, "poll: %.100s\n", strerror(errno));
+			continue;
+		}
+		for (i = 0; i < num_listen_socks; i++) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			fromlen = sizeof(from);
+			newsock = accept(listen_socks[i],
+			    (struct sockaddr *)&from, &fromlen);
+			if (newsock < 0) {
+				if (errno != EINTR && errno != EWOULDBLOCK) {
+					STATS_ADD(hdd_stats->accept_errors, 1);
+					fprintf(stderr, "accept: %.100s\n",
+					    strerror(errno));
+				}
+				continue;
+			}
+			STATS_ADD(hdd_stats->accepts, 1);
+			accepted = stats_now();
+			if (admit_check(a->admit, (struct sockaddr *)&from,
+			    0) != ADMIT_OK) {
+				client_shed(newsock);
+				continue;
+			}
+			fcntl(newsock, F_SETFL, 0);
+			client_serve(newsock, accepted);
+		}
+	}
+	/* NOTREACHED */
+	return NULL;
+}
+
+/* run acceptors[0] on the calling thread, never returns */
+static void
+client_threads(void)
+{
+	int i, error;
+
+	/* the threads race for connections, a loser must not block */
+	for (i = 0; i < num_listen_socks; i++)
+		if (fcntl(listen_socks[i], F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+	if ((acceptors = calloc(acceptor_threads,
+	    sizeof(struct acceptor))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < acceptor_threads; i++)
+		acceptors[i].admit = admit_table_new();
+
+	/* a thread mode answer must not need [priv] every time */
+	if (cache_fresh == 0)
+		cache_fresh = 1;
+
+	setproctitle("%s", "[listener]");
+	for (i = 1; i < acceptor_threads; i++)
+		if ((error = pthread_create(&acceptors[i].thread, NULL,
+		    client_acceptor, &acceptors[i])) != 0)
+			errc(1, error, "pthread_create");
+	client_acceptor(&acceptors[0]);
+}
+
 /*
  * Copyright (c) 2000, 2001, 2002 Markus Friedl.  All rights reserved.
  * Copyright (c) 2002 Niels Provos.  All rights reserved.
@@ -282,27 +833,25 @@ main_sigchld_handler(int sig)
  */
 int client_linsten()
 {
-	struct sockaddr *sa;
-        char *name = DEFAULT_HOST;
-	char *service = DEFAULT_PORT;
+        char *name = listen_host;
+	char *service = listen_port;
         struct addrinfo hints;
         struct addrinfo *res, *res0;
-	int listen_sock, maxfd;
+	int maxfd;
 	socklen_t fromlen;
-	int sock_in = -1, sock_out = -1, newsock = -1;
+	int sock_in = -1, newsock = -1;
 	int error;
-	u_int8_t salen;
-	char ntop[NI_MAXHOST], strport[NI_MAXSERV];
 	int fdsetsz;
-	int on = 1;
 	fd_set *fdset;
+	struct admit_table *admit;
 	struct sockaddr_storage from;
+	sigset_t chldmask, omask;
 	int ret;
 	int i;
 	int pid;
-	int readlen;
-	char buf[BUFSIZ];
-	int outlen;
+	int worker = 0;
+	int taken = 0;
+	u_int64_t accepted = 0;
 
 	/*
          * getaddrinfo() case.  You can get IPv6 address and IPv4 address
@@ -320,94 +869,91 @@ int client_linsten()
 		exit(1);
 	}
 
+	/*
+	 * a running daemon hands its sockets over, the unix one included,
+	 * and is succeeded on the handover socket as well.
+	 */
+	if (handover_path) {
+		if ((taken = handover_take(listen_socks,
+		    MAX_LISTEN_SOCKS)) == -1)
+			exit(1);
+		num_listen_socks = taken;
+		handover_sock = listen_unix(handover_path, 0600);
+	}
+
+	/* the [priv] process closes it again */
+	if (unix_listen_path && !taken)
+		listen_socks[num_listen_socks++] =
+		    listen_unix(unix_listen_path, unix_listen_mode);
+
         /* Privilege separation begins here */
         if (privsep_init()) {
                 fprintf(stderr, "unable to privsep");
                 exit(1);
         }
+	/*
+	 * a client may reset under a write; inherited by the connection
+	 * children, the -P workers and the -T threads
+	 */
+	signal(SIGPIPE, SIG_IGN);
 
 	res0 = res;
 
-	for ( ; res; res = res->ai_next) {
-		sa = res->ai_addr;
-		salen = res->ai_addrlen;
-
-		if (res->ai_family != AF_INET && res->ai_family != AF_INET6)
-			continue;
-
-		if (num_listen_socks >= MAX_LISTEN_SOCKS) {
-			fprintf(stderr,
-				"Too many listen sockets. "
-				"Enlarge MAX_LISTEN_SOCKS\n");
-			exit(1);
-		}
-		if (getnameinfo(sa, salen,
-				ntop, sizeof(ntop), strport, sizeof(strport),
-				NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
-			fprintf(stderr, "getnameinfo failed\n");
-			continue;
-		}
-		/* Create socket for listening. */
-		listen_sock = socket(res->ai_family, res->ai_socktype,
-				     res->ai_protocol);
-		if (listen_sock < 0) {
-			/* kernel may not support ipv6 */
-			fprintf(stderr, "socket: %.100s\n", strerror(errno));
-			continue;
-		}
-
-		/*
-		 * Set socket options.
-		 * Allow local port reuse in TIME_WAIT.
-		 */
-		if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR,
-			       &on, sizeof(on)) == -1)
-			fprintf(stderr, "setsockopt SO_REUSEADDR: %s\n", strerror(errno));
-
-		if (bind(listen_sock, sa, salen) < 0) {
-			fprintf(stderr, "Bind to port %s on %s failed: %.200s.\n",
-				strport, ntop, strerror(errno));
-			close(listen_sock);
-			continue;
-		}
-		listen_socks[num_listen_socks] = listen_sock;
-		num_listen_socks++;
-
-		/* Start listening on the port. */
-#if 0
-		printf("Server listening on %s port %s.\n", ntop, strport);
-#endif
-		if (listen(listen_sock, 127) < 0) {
-			fprintf(stderr, "listen: %.100s\n", strerror(errno));
-			exit(1);
-		}
-	}
+	if (!taken)
+		num_listen_socks = listen_bind(res0, listen_socks,
+		    num_listen_socks);
 
 	freeaddrinfo(res0);
 
 	/* Arrange SIGCHLD to be caught. */
 	signal(SIGCHLD, main_sigchld_handler);
+	sigemptyset(&chldmask);
+	sigaddset(&chldmask, SIGCHLD);
+
+	/* before any thread or worker exists */
+	if (proxy_list)
+		proxy_pid = proxy_start();
+
+	if (acceptor_threads > 0)
+		client_threads();
+
+	/* returns in a worker only */
+	if (prefork_workers > 0)
+		worker = client_prefork();
+	admit = admit_table_new();
 
 	/* setup fd set for listen */
-	fdset = NULL;
 	maxfd = 0;
 	for (i = 0; i < num_listen_socks; i++)
 		if (listen_socks[i] > maxfd)
 			maxfd = listen_socks[i];
+	if (handover_sock > maxfd)
+		maxfd = handover_sock;
+	if (worker && handover_pipe[0] > maxfd)
+		maxfd = handover_pipe[0];
+
+	/* the sockets never change, neither does the set */
+	fdsetsz = howmany(maxfd + 1, NFDBITS) * sizeof(fd_mask);
+	if ((fdset = (fd_set *)malloc(fdsetsz)) == NULL)
+		err(1, "malloc");
 
 	/*
 	 * Stay listening for connections until the system crashes or
 	 * the daemon is killed with a signal.
 	 */
 	for ( ; ; ) {
-		if (fdset != NULL)
-			free(fdset);
-		fdsetsz = howmany(maxfd + 1, NFDBITS) * sizeof(fd_mask);
-		fdset = (fd_set *)malloc(fdsetsz);
+		if (!worker) {
+			hdd_stats->children = num_children;
+			stats_proc_update(&hdd_stats->listener);
+		}
 		memset(fdset, 0, fdsetsz);
 
 		for (i = 0; i < num_listen_socks; i++)
 			FD_SET(listen_socks[i], fdset);
+		if (handover_sock != -1)
+			FD_SET(handover_sock, fdset);
+		if (worker && handover_pipe[0] != -1)
+			FD_SET(handover_pipe[0], fdset);
 
 		/* Wait in select until there is a connection. */
 		ret = select(maxfd + 1, fdset, NULL, NULL, NULL);
@@ -415,6 +961,14 @@ int client_linsten()
 			fprintf(stderr, "select: %.100s\n", strerror(errno));
 		if (ret < 0)
 			continue;
+		if (handover_sock != -1 && FD_ISSET(handover_sock, fdset) &&
+		    handover_give(handover_sock, listen_socks,
+		    num_listen_socks) == 0)
+			client_drain();
+		/* the listener handed the sockets over, or is gone */
+		if (worker && handover_pipe[0] != -1 &&
+		    FD_ISSET(handover_pipe[0], fdset))
+			_exit(0);
 		for (i = 0; i < num_listen_socks; i++) {
 			if (!FD_ISSET(listen_socks[i], fdset))
 				continue;
@@ -422,16 +976,35 @@ int client_linsten()
 			newsock = accept(listen_socks[i], (struct sockaddr *)&from,
 					 &fromlen);
 			if (newsock < 0) {
-				if (errno != EINTR && errno != EWOULDBLOCK)
+				if (errno != EINTR && errno != EWOULDBLOCK) {
+					STATS_ADD(hdd_stats->accept_errors, 1);
 					fprintf(stderr, "accept: %.100s\n", strerror(errno));
+				}
+				continue;
+			}
+			STATS_ADD(hdd_stats->accepts, 1);
+			accepted = stats_now();
+			if (admit_check(admit, (struct sockaddr *)&from,
+			    worker ? 0 : num_children) != ADMIT_OK) {
+				client_shed(newsock);
+				continue;
+			}
+			/* a pre-forked worker serves the connection itself */
+			if (worker) {
+				/* may inherit O_NONBLOCK of the listen socket */
+				fcntl(newsock, F_SETFL, 0);
+				client_serve(newsock, accepted);
 				continue;
 			}
 			/*
 			 * Normal production daemon.  Fork, and have
 			 * the child process the connection. The
-			 * parent continues listening.
+			 * parent continues listening.  The handler must
+			 * not see the child before it is counted.
 			 */
+			sigprocmask(SIG_BLOCK, &chldmask, &omask);
 			if ((pid = fork()) == 0) {
+				sigprocmask(SIG_SETMASK, &omask, NULL);
 				/*
 				 * Child.  Close the listening and max_startup
 				 * sockets.  Start using the accepted socket.
@@ -441,12 +1014,17 @@ int client_linsten()
 				 */
 				close_listen_socks();
 				sock_in = newsock;
-				sock_out = newsock;
 				break;
 			}
 			/* Parent.  Stay in the loop. */
-			if (pid < 0)
+			if (pid < 0) {
+				STATS_ADD(hdd_stats->fork_errors, 1);
 				fprintf(stderr, "fork: %.100s\n", strerror(errno));
+			} else {
+				num_children++;
+				STATS_ADD(hdd_stats->forks, 1);
+			}
+			sigprocmask(SIG_SETMASK, &omask, NULL);
 			
 			/* Close the new socket (the child is now taking care of it). */
 			close(newsock);
@@ -459,38 +1037,364 @@ int client_linsten()
 	/* This is the child processing a new connection. */
         setproctitle("%s", "[accepted]");
 
-	outlen = 0;
+	client_serve(sock_in, accepted);
+	_exit(0);
+}
 
-	/* pass to priv server */
-	memset(buf, 0, BUFSIZ);
-	readlen = priv_get_temperature(buf);
-	/* revieve to client */
-	write(sock_out, buf, readlen);
+/* seconds between two lines of the stand alone mode, 0 prints once */
+int watch_interval = 0;
+/* print a device only when its reading changed */
+int watch_changes = 0;
+/* OUTPUT_* of the stand alone mode */
+int output_format = OUTPUT_TEXT;
 
-	if (readlen < 0)
-		fprintf(stderr, "read: %.100s\n", strerror(errno));
+/* indexed by the SAMPLE_* status */
+static const char *output_status[] = { "OK", "ERR", "UNK" };
 
-	close(sock_in);
-	close(sock_out);
-	_exit(0);
+static void
+output_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((u_char)*s < 0x20)
+			printf("\\u%04x", (u_char)*s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+static void
+output_csv_string(const char *s)
+{
+	if (strpbrk(s, ",\"\r\n") == NULL) {
+		fputs(s, stdout);
+		return;
+	}
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"')
+			putchar('"');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+/* one device in the format of -o, n counts the records of the round */
+static void
+output_record(struct hdd_device *dev, time_t now, int n)
+{
+	const char *status = output_status[dev->status];
+
+	switch (output_format) {
+	case OUTPUT_JSON:
+		printf("%s\n  {\"time\": %lld, \"dev\": ", n ? "," : "",
+		    (long long)now);
+		output_json_string(dev->dev);
+		printf(", \"model\": ");
+		if (dev->model)
+			output_json_string(dev->model);
+		else
+			printf("null");
+		printf(", \"serial\": ");
+		if (dev->serial)
+			output_json_string(dev->serial);
+		else
+			printf("null");
+		if (dev->status)
+			printf(", \"temp\": null");
+		else
+			printf(", \"temp\": %d", dev->temp);
+		printf(", \"status\": \"%s\"}", status);
+		break;
+	case OUTPUT_CSV:
+		printf("%lld,", (long long)now);
+		output_csv_string(dev->dev);
+		putchar(',');
+		if (dev->model)
+			output_csv_string(dev->model);
+		putchar(',');
+		if (dev->serial)
+			output_csv_string(dev->serial);
+		if (dev->status)
+			printf(",,%s\n", status);
+		else
+			printf(",%d,%s\n", dev->temp, status);
+		break;
+	default:
+		if (dev->status & SAMPLE_ERR)
+			break;
+		if (watch_interval)
+			printf("%lld ", (long long)now);
+		if (dev->status & SAMPLE_UNK)
+			printf("%s: %s: UNK\n", dev->dev, dev->model);
+		else
+			printf("%s: %s: %dC\n", dev->dev, dev->model,
+			    dev->temp);
+		break;
+	}
+}
+
+/* runs under disk_parallel() */
+static void
+standalone_read(struct hdd_device *dev)
+{
+	if (dev->model == NULL)
+		dev->reading = -1;
+	else
+		dev->reading = dev->db ? device_temperature(dev) : INT_MAX;
+}
+
+/*
+ * Stand alone mode.  The disks are read all at once, and in watch mode
+ * they stay open and matched, so a round costs one SMART read of the
+ * slowest disk.  With -o json or csv every disk is reported, the ones
+ * which failed or are unknown to the database included.
+ */
+static int
+standalone(void)
+{
+	struct hdd_device *dev;
+	time_t now, next_rescan;
+	int temp, status, n, first = 1, ret = 0;
+
+	next_rescan = time(NULL) + disk_rescan_interval;
+	for (;;) {
+		now = time(NULL);
+		if (disk_enum && disk_rescan_interval && now >= next_rescan) {
+			disk_rescan();
+			next_rescan = now + disk_rescan_interval;
+		}
+
+		disk_parallel(hdd_devices, standalone_read);
+
+		if (output_format == OUTPUT_JSON)
+			printf("[");
+		else if (output_format == OUTPUT_CSV && first)
+			printf("time,dev,model,serial,temp,status\n");
+		first = 0;
+		n = 0;
+		for (dev = hdd_devices; dev; dev = dev->next) {
+			if (output_format == OUTPUT_TEXT &&
+			    (dev->model == NULL || dev->db == NULL))
+				continue;
+			temp = dev->reading;
+			if (temp < 0) {
+				ret = 1;
+				status = SAMPLE_ERR;
+			} else if (temp == INT_MAX)
+				status = SAMPLE_UNK;
+			else
+				status = 0;
+			if (watch_changes && dev->sampled &&
+			    dev->status == status &&
+			    (status != 0 || dev->temp == temp))
+				continue;
+			dev->sampled = now;
+			dev->status = status;
+			dev->temp = temp;
+			output_record(dev, now, n++);
+		}
+		if (output_format == OUTPUT_JSON)
+			printf("%s]\n", n ? "\n" : "");
+		fflush(stdout);
+		if (state_dirty)
+			state_save();
+
+		if (watch_interval == 0)
+			return ret;
+		sleep(watch_interval);
+	}
 }
 
 int
 main(int argc, char *argv[])
 {
-	int temp;
+	struct hdd_device *dev;
+	const char *errstr;
+	char *ep;
 	int ch;
-        char dvname_store[MAXPATHLEN];
 	int daemon_mode = 0;
+	int ret = 0;
 	char *dbfile = NULL;
 
-	while ((ch = getopt(argc, argv, "df:")) != -1) {
+	while ((ch = getopt(argc, argv, "aA:b:C:c:dF:f:H:i:j:k:L:l:m:n:Oo:P:p:q:R:r:S:s:T:t:u:W:w:X:x:")) != -1) {
 		switch (ch) {
+		case 'a':
+			disk_enum = &disk_enum_sysctl;
+			break;
+		case 'A':
+			/* daemon() changes to "/" */
+			disk_enum = &disk_enum_dir;
+			if ((disk_enum_arg = realpath(optarg, NULL)) == NULL)
+				err(1, "%s", optarg);
+			break;
+		case 'b':
+			admit_backlog = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "backlog is %s: %s", errstr, optarg);
+			break;
+		case 'C':
+			scrape_list = strdup(optarg);
+			break;
+		case 'c':
+			admit_max_conns = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "connection limit is %s: %s", errstr,
+				    optarg);
+			break;
 		case 'd':
 			daemon_mode = 1;
 			break;
+		case 'F':
+			cache_fresh = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "cache age is %s: %s", errstr, optarg);
+			break;
 		case 'f':
-			dbfile = strdup(optarg);
+			/* read again on SIGHUP, after daemon() went to "/" */
+			if ((dbfile = realpath(optarg, NULL)) == NULL)
+				err(1, "%s", optarg);
+			break;
+		case 'H':
+			alert_hyst = strtonum(optarg, 0, 100, &errstr);
+			if (errstr)
+				errx(1, "hysteresis is %s: %s", errstr, optarg);
+			break;
+		case 'i':
+			proxy_interval = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "poll interval is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'j':
+			priv_helpers = strtonum(optarg, 0, PRIV_MAXHELPERS,
+			    &errstr);
+			if (errstr)
+				errx(1, "number of helpers is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'k':
+			/* daemon() changes to "/" */
+			if (*optarg != '/')
+				errx(1, "handover socket must be an absolute "
+				    "path");
+			handover_path = strdup(optarg);
+			break;
+		case 'L':
+			if ((ep = strdup(optarg)) == NULL)
+				err(1, "strdup");
+			if (net_hostport(ep, &listen_host, &listen_port) == -1)
+				errx(1, "bad listen address: %s", optarg);
+			/* ":port" for any address */
+			if (*listen_host == '\0')
+				listen_host = NULL;
+			break;
+		case 'l':
+			admit_rate = strtonum(optarg, 0, 1000000, &errstr);
+			if (errstr)
+				errx(1, "rate is %s: %s", errstr, optarg);
+			break;
+		case 'm':
+			unix_listen_mode = strtol(optarg, &ep, 8);
+			if (*optarg == '\0' || *ep != '\0' ||
+			    unix_listen_mode & ~0777)
+				errx(1, "bad socket mode: %s", optarg);
+			break;
+		case 'n':
+			disk_rescan_interval = strtonum(optarg, 0, INT_MAX,
+			    &errstr);
+			if (errstr)
+				errx(1, "rescan interval is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'O':
+			watch_changes = 1;
+			break;
+		case 'o':
+			if (strcmp(optarg, "text") == 0)
+				output_format = OUTPUT_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				output_format = OUTPUT_JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				output_format = OUTPUT_CSV;
+			else
+				errx(1, "unknown output format: %s", optarg);
+			break;
+		case 'P':
+			prefork_workers = strtonum(optarg, 0, 1024, &errstr);
+			if (errstr)
+				errx(1, "number of workers is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'p':
+			proxy_list = strdup(optarg);
+			break;
+		case 'q':
+			query_wait = strtonum(optarg, 0, 60000, &errstr);
+			if (errstr)
+				errx(1, "query wait is %s: %s", errstr, optarg);
+			break;
+		case 'R':
+			trace_replaying = 1;
+			/* FALLTHROUGH */
+		case 'r':
+			trace_file = optarg;
+			break;
+		case 'S':
+			/* daemon() changes to "/" */
+			if (*optarg != '/')
+				errx(1, "state file must be an absolute path");
+			state_file = strdup(optarg);
+			break;
+		case 's':
+			sample_interval = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "sample interval is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'T':
+			acceptor_threads = strtonum(optarg, 0, 256, &errstr);
+			if (errstr)
+				errx(1, "number of threads is %s: %s", errstr,
+				    optarg);
+			break;
+		case 't':
+			cache_ttl = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "cache ttl is %s: %s", errstr, optarg);
+			break;
+		case 'u':
+			/* daemon() changes to "/" */
+			if (*optarg != '/')
+				errx(1, "socket path must be an absolute path");
+			unix_listen_path = strdup(optarg);
+			break;
+		case 'W':
+			alert_warn = strtonum(optarg, 0, 255, &errstr);
+			if (errstr)
+				errx(1, "warning threshold is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'w':
+			watch_interval = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "watch interval is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'X':
+			alert_crit = strtonum(optarg, 0, 255, &errstr);
+			if (errstr)
+				errx(1, "critical threshold is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'x':
+			fetch_timeout = strtonum(optarg, 1, 600000, &errstr);
+			if (errstr)
+				errx(1, "fetch timeout is %s: %s", errstr,
+				    optarg);
 			break;
 		default:
 			break;
@@ -500,53 +1404,86 @@ main(int argc, char *argv[])
         argv += optind;
         argc -= optind;
 
-        if (argc == 0)
+	/* client mode needs neither devices nor database */
+	if (scrape_list)
+		exit(scrape_run(scrape_list));
+
+	/* before any device is opened, a replay takes its devices too */
+	if (trace_open() == -1)
+		exit(1);
+	if (trace_replaying && argc == 0 && disk_enum == NULL)
+		disk_enum = &disk_enum_trace;
+
+        if (argc == 0 && disk_enum == NULL && proxy_list == NULL)
                 usage();
+	if (proxy_list && !daemon_mode)
+		errx(1, "-p needs -d");
+	if (prefork_workers && acceptor_threads)
+		errx(1, "-P and -T are exclusive");
+	if (output_format != OUTPUT_TEXT && daemon_mode)
+		errx(1, "-o is for the stand alone mode");
+	if (priv_helpers && !daemon_mode)
+		errx(1, "-j needs -d");
+	if (handover_path && (!daemon_mode || acceptor_threads))
+		errx(1, "-k needs -d and no -T");
 
 	if (!dbfile)
 		dbfile = HDDTEMP_DBFILE;
+	hdd_dbfile = dbfile;
 
-	hdd_dev = strdup(argv[0]);
+	/* counters must be shared before the first fork */
+	if (daemon_mode) {
+		stats_init();
+		cache_init();
+		openlog(__progname, LOG_PID | LOG_NDELAY, LOG_DAEMON);
+	}
+
+	if (state_load() == -1)
+		exit(1);
 
         /*
-         * Open the device
+         * Open the devices given by hand, then the discovered ones
          */
-        hdd_fd = opendisk(hdd_dev, O_RDWR, dvname_store, sizeof(dvname_store), 0);
-        if (hdd_fd == -1) {
-                if (errno == ENOENT) {
-                        /*
-                         * Device doesn't exist.  Probably trying to open
-                         * a device which doesn't use disk semantics for
-                         * device name.  Try again, specifying "cooked",
-                         * which leaves off the "r" in front of the device's
-                         * name.
-                         */
-                        hdd_fd = opendisk(hdd_dev, O_RDWR, dvname_store,
-                            sizeof(dvname_store), 1);
-                        if (hdd_fd == -1)
-                                err(1, "%s", hdd_dev);
-                } else
-                        err(1, "%s", hdd_dev);
-        }
+	if (disk_open_all(argv, argc, output_format != OUTPUT_TEXT) == -1 &&
+	    output_format == OUTPUT_TEXT)
+		exit(1);
+	if (disk_enum && disk_rescan() == -1)
+		exit(1);
 
-	hdd_model = ata_model();
+	/* upstreams are resolved before the chroot */
+	if (proxy_list && proxy_load(proxy_list) == -1)
+		exit(1);
 
-	/* database open */
-	hdd_db = search_hdd_model(dbfile, hdd_model);
-	if (hdd_db == NULL) {
-		fprintf(stderr, "cannot find from database: \"%s\"\n", hdd_model);
+	/* database open, one parse for all devices the state misses */
+	state_apply();
+	switch (hdd_devices || disk_enum ? disk_match(0) : 0) {
+	case 0:
+		break;
+	case -1:
 		exit(1);
+	default:
+		/* a disk given by hand must be known, or be reported so */
+		for (dev = hdd_devices; dev; dev = dev->next)
+			if (dev->pinned && dev->db == NULL &&
+			    output_format == OUTPUT_TEXT)
+				exit(1);
 	}
 
-	/* stand alone */
-	if (!daemon_mode) {
-		temp = smart_temperature();
+	state_save();
 
-		if (strcmp(hdd_db->unit, "C") == 0)
-			temp = ftoc(temp);
+	/* thresholds are worth little unless sampled on their own */
+	if (!sample_interval) {
+		for (dev = hdd_devices; dev; dev = dev->next)
+			if (dev->db && (dev->db->warn || dev->db->crit))
+				break;
+		if (alert_warn || alert_crit || dev != NULL)
+			sample_interval = 10;
+	}
 
-		printf("%s: %s: %dC\n", hdd_dev, hdd_model, temp);
-	} else {
+	/* stand alone */
+	if (!daemon_mode)
+		ret = standalone();
+	else {
 		/* daemon_mode */
 		if (daemon(0, 1)) {
 			errx(2, "fork failed");
@@ -554,5 +1491,5 @@ main(int argc, char *argv[])
 
 		client_linsten();
 	}
-	return 0;
+	return ret;
 }
@@ -119,7 +119,6 @@ struct smart_threshold {
 
 /* default attribute id */
 #define SMART_TEMPERATURE 194
-int smart_temperature();
 
 /* if you want to bind from any address, set NULL */
 #define DEFAULT_HOST "localhost"
@@ -132,26 +131,341 @@ int smart_temperature();
 #define ftoc(f) (int)(((double)f - 32.) / 1.8)
 #define ctof(c) (int)(1.8 * (double)c + 32.)
 
+/* size of a rendered daemon reply, a proxy merges several */
+#define HDDTEMP_REPLYMAX 65536
+
 #define DBLINEBUFMAX 256
 #define HDDTEMP_DBFILE "/usr/local/share/hddtemp/hddtemp.db"
 
 typedef struct hdd_database {
 	struct hdd_database *next;
 	char *model_regexp;
-	int id;
-	char *unit;
 	char *model;
+	const char *unit;	/* interned, never freed */
+	u_int8_t id;
+	u_int8_t warn;		/* alert thresholds in C, 0 for the default */
+	u_int8_t crit;
 } hdd_database;
 
-extern int hdd_fd;
-extern char *hdd_model;
-extern char *hdd_dev;
-extern hdd_database *hdd_db;
+/* parsed hddtemp.db, all entries live in one arena */
+struct hdd_dbfile;
+
+struct sketch;
+
+/* a monitored disk */
+struct hdd_device {
+	struct hdd_device *next;
+	char *dev;		/* name as given or enumerated */
+	int fd;
+	char *model;		/* NULL if the device cannot be identified */
+	char *serial;		/* from IDENTIFY, NULL if unknown */
+	hdd_database *db;	/* NULL if the model is unknown */
+	int pinned;		/* given by hand, never detached by rescan */
+	int seen;		/* found by the last rescan */
+	int stats_slot;		/* index in hdd_stats->dev, or -1 */
+	int attr_slot;		/* index of db->id in the SMART data, or -1 */
+	int temp;		/* last sample in C, see status */
+	int status;		/* SAMPLE_* flags of the last sample */
+	time_t sampled;		/* time of the last sample */
+	int alert;		/* ALERT_* level */
+	struct sketch *sketch;	/* summaries of the readings, or NULL */
+	int trace_pos;		/* next command to replay */
+	int helper;		/* [priv] helper which reads it */
+	int reading;		/* device_temperature() of the last sample */
+};
+
+#define SAMPLE_ERR	0x01	/* the device failed */
+#define SAMPLE_UNK	0x02	/* unknown model or attribute */
+
+extern struct hdd_device *hdd_devices;
+extern char *hdd_dbfile;
+
+struct atareq;
+int ata_command(struct hdd_device *, struct atareq *);
+char *ata_model(struct hdd_device *);
+int smart_temperature(struct hdd_device *);
+int device_temperature(struct hdd_device *);
+
+struct hdd_dbfile *database_open(char *);
+hdd_database* database_match(struct hdd_dbfile *, char *);
+void database_close(struct hdd_dbfile *);
+void database_free(hdd_database *);
+hdd_database* database_entry(const char *, const char *, int, const char *,
+    int, int);
+
+/*
+ * identify and match results kept across restarts
+ */
+extern char *state_file;
+extern int state_dirty;
+
+int state_load(void);
+void state_apply(void);
+void state_save(void);
+
+/*
+ * disk discovery
+ */
+typedef void (*disk_enum_cb)(const char *, void *);
+struct disk_enumerator {
+	const char *name;
+	int (*enumerate)(const char *, disk_enum_cb, void *);
+};
+extern const struct disk_enumerator disk_enum_sysctl;
+extern const struct disk_enumerator disk_enum_dir;
+extern const struct disk_enumerator *disk_enum;
+extern char *disk_enum_arg;
+extern int disk_rescan_interval;
+
+#define DISK_MAXTHREADS	16
+
+/* stand alone output */
+#define OUTPUT_TEXT	0
+#define OUTPUT_JSON	1
+#define OUTPUT_CSV	2
+
+int disk_open_all(char **, int, int);
+void disk_parallel(struct hdd_device *, void (*)(struct hdd_device *));
+void disk_close(struct hdd_device *);
+void disk_add(struct hdd_device *);
+int disk_match(int);
+int disk_rescan(void);
+int disk_controller(const char *);
+
+/*
+ * performance counters shared by every process of the daemon
+ */
+#define STATS_HIST_BUCKETS 24	/* bucket i: below 2^i microseconds */
+#define STATS_MAXDEV 32
+#define STATS_ADD(v, n) __sync_fetch_and_add(&(v), (n))
+
+struct stats_hist {
+	u_int64_t count;
+	u_int64_t sum_us;
+	u_int64_t bucket[STATS_HIST_BUCKETS];
+};
+
+/* gauges of a process, a steady rise over a long run is a leak */
+struct stats_proc {
+	u_int64_t maxrss_kb;
+	u_int64_t fds;
+};
+
+struct hdd_stats {
+	u_int64_t accepts;
+	u_int64_t accept_errors;
+	u_int64_t forks;
+	u_int64_t fork_errors;
+	u_int64_t reaped;		/* children waited for */
+	u_int64_t requests;
+	u_int64_t stats_requests;
+	u_int64_t binary_requests;
+	u_int64_t errors;
+	u_int64_t ioctl_errors;
+	u_int64_t shed_busy;		/* over the connection limit */
+	u_int64_t shed_rate;		/* over the per source rate */
+	u_int64_t cache_hits;		/* shed, answered from the cache */
+	u_int64_t rejected;		/* shed, closed without a reply */
+	u_int64_t cached;		/* answered from the cache */
+	u_int64_t upstream_errors;	/* proxy: failed or malformed fetches */
+	u_int64_t alerts;		/* threshold crossings */
+	u_int64_t not_modified;		/* SINCE answered NOTMODIFIED */
+	u_int64_t children;		/* connection children or workers */
+	struct stats_proc listener;
+	struct stats_proc priv;
+	struct stats_hist privsep_rtt;	/* query to [priv] and back */
+	struct stats_hist service;	/* accept to close */
+	struct {
+		char name[32];
+		struct stats_hist ioctl;	/* ata_command() */
+	} dev[STATS_MAXDEV];
+};
+
+extern struct hdd_stats *hdd_stats;
+
+void stats_init(void);
+u_int64_t stats_now(void);
+void stats_hist_add(struct stats_hist *, u_int64_t);
+void stats_proc_update(struct stats_proc *);
+int stats_dev_attach(const char *);
+void stats_dev_detach(int);
+int stats_render(char *, size_t);
+
+/*
+ * last reply, shared by every process of the daemon
+ */
+extern int cache_ttl;
+extern int cache_fresh;
+
+void cache_init(void);
+void cache_store(const char *, int);
+int cache_load(char *, size_t, int);
+int cache_export(char *, size_t, int, u_int64_t *);
+void cache_import(const char *, int, u_int64_t);
+
+/*
+ * admission control of the listener
+ */
+#define ADMIT_OK	0
+#define ADMIT_BUSY	1
+#define ADMIT_RATE	2
+
+extern int admit_max_conns;
+extern int admit_rate;
+extern int admit_backlog;
+
+struct sockaddr;
+struct admit_table;
+struct admit_table *admit_table_new(void);
+int admit_check(struct admit_table *, struct sockaddr *, int);
+
+/*
+ * listener
+ */
+#define MAX_LISTEN_SOCKS 16
+
+extern char *unix_listen_path;
+void close_listen_socks(void);
+
+/*
+ * restart with the listen sockets handed over
+ */
+#define HANDOVER_EXIT	3	/* status of a listener which handed over */
+
+extern char *handover_path;
+
+int handover_take(int *, int);
+int handover_give(int, int *, int);
+
+/*
+ * record and replay of ata_command()
+ */
+extern char *trace_file;
+extern int trace_replaying;
+extern const struct disk_enumerator disk_enum_trace;
+
+int trace_open(void);
+void trace_record(struct hdd_device *, struct atareq *, int, u_int64_t);
+int trace_replay(struct hdd_device *, struct atareq *);
+
+/*
+ * moving averages and quantiles of the readings, kept by [priv]
+ */
+void sketch_add(struct hdd_device *, time_t);
+void sketch_free(struct hdd_device *);
+int sketch_render(char *, size_t);
+
+/*
+ * threshold alerts, run by [priv]
+ */
+#define ALERT_NONE	0
+#define ALERT_WARN	1
+#define ALERT_CRIT	2
+#define ALERT_MAXSUB	16	/* subscribers at once */
+
+extern int alert_warn;
+extern int alert_crit;
+extern int alert_hyst;
+
+struct pollfd;
+void alert_check(struct hdd_device *);
+int alert_subscribe(int);
+int alert_pollfd(struct pollfd *);
+void alert_reap(struct pollfd *, int);
+
+/*
+ * concurrent fetches of other daemons' replies
+ */
+#define FETCH_BUFMAX	8192	/* reply of one daemon */
+
+#define FETCH_CONNECT	0
+#define FETCH_READ	1
+#define FETCH_DONE	2
+#define FETCH_FAIL	3
+
+struct addrinfo;
+struct fetch {
+	char *name;		/* "host[:port]" as given */
+	struct addrinfo *ai;
+	int fd;
+	int state;		/* FETCH_* */
+	const char *error;	/* why it failed */
+	u_int64_t start;	/* stats_now() of the connect */
+	u_int64_t elapsed;	/* microseconds until done or failed */
+	size_t len;
+	char buf[FETCH_BUFMAX];
+};
+
+int net_hostport(char *, char **, char **);
+int fetch_init(struct fetch *, const char *);
+struct fetch *fetch_load(const char *, int *);
+void fetch_run(struct fetch *, int, int, void (*)(struct fetch *, void *),
+    void *);
+int reply_parse(char *, size_t,
+    void (*)(char *, char *, char *, char *, void *), void *);
+
+/*
+ * aggregating proxy
+ */
+extern char *proxy_list;
+extern int proxy_interval;
+extern int fetch_timeout;
+
+int proxy_load(const char *);
+pid_t proxy_start(void);
+
+/*
+ * client mode
+ */
+extern char *scrape_list;
 
-hdd_database* search_hdd_model(char *, char *);
+int scrape_run(const char *);
+
+/*
+ * Binary reply, asked for by the query byte HDDTEMP_BIN_QUERY alone or
+ * by HDDTEMP_BIN_QUERY_GEN followed by the little endian table_gen the
+ * client knows.  A header, nrec records, then the string table
+ * ("dev\0model\0" per record, in record order) unless the client
+ * already has table_gen.  Every field is little endian.
+ */
+#define HDDTEMP_BIN_QUERY	'B'
+#define HDDTEMP_BIN_QUERY_GEN	0xb1	/* not text, no query starts so */
+#define HDDTEMP_BIN_VERSION	1
+#define HDDTEMP_BIN_TABLE	0x01	/* flags: string table follows */
+#define HDDTEMP_BIN_PARTIAL	0x02	/* flags: devices left out, no room */
+
+struct hddtemp_bin_header {
+	u_int8_t  magic[2];	/* "HT" */
+	u_int8_t  version;
+	u_int8_t  flags;
+	u_int16_t nrec;
+	u_int16_t reserved;
+	u_int32_t table_gen;	/* changes with the string table */
+	u_int32_t table_len;	/* 0 when the table is left out */
+} __packed;
+
+struct hddtemp_bin_record {
+	u_int16_t devid;	/* index in the string table */
+	int16_t   temp;		/* tenths of a degree C */
+	u_int16_t status;	/* SAMPLE_* */
+	u_int16_t reserved;
+	u_int64_t stamp;	/* time of the sample, seconds since epoch */
+} __packed;
 
 /*
  * main loop on daemon mode
  */
+#define PRIV_TEMPERATURE	1	/* text reply */
+#define PRIV_BINARY		2	/* binary reply, arg is table_gen */
+#define PRIV_SUBSCRIBE		3	/* hand a connection over for alerts */
+#define PRIV_SINCE		4	/* text reply unless arg is its generation */
+#define PRIV_SUMMARY		5	/* sketch_render() */
+
+#define PRIV_MAXHELPERS		32
+
+extern int sample_interval;
+extern int priv_helpers;
+
 int privsep_init(void);
-int priv_get_temperature(char *);
+int priv_request(int, u_int32_t, char *, size_t);
+int priv_subscribe(int);
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hddtemp.h"
+
+/*
+ * Split "host", "host:port" or "[v6addr]:port" in place.  port is
+ * left alone when spec has none.
+ */
+int
+net_hostport(char *spec, char **host, char **port)
+{
+	char *p;
+
+	if (*spec == '[') {
+		if ((p = strchr(spec, ']')) == NULL)
+			return -1;
+		*p++ = '\0';
+		*host = spec + 1;
+		if (*p == ':')
+			*port = p + 1;
+		else if (*p != '\0')
+			return -1;
+		return 0;
+	}
+	*host = spec;
+	/* more than one colon is a bare IPv6 address */
+	if ((p = strchr(spec, ':')) != NULL && strchr(p + 1, ':') == NULL) {
+		*p = '\0';
+		*port = p + 1;
+	}
+	return 0;
+}
+
+/*
+ * Resolve spec ("host[:port]") of a daemon to fetch from.  On failure
+ * f->error says why and f is kept, it simply fails every fetch_run().
+ */
+int
+fetch_init(struct fetch *f, const char *spec)
+{
+	struct addrinfo hints;
+	char *s, *host, *port = DEFAULT_PORT;
+	int error;
+
+	memset(f, 0, sizeof(*f));
+	f->fd = -1;
+	if ((f->name = strdup(spec)) == NULL || (s = strdup(spec)) == NULL)
+		err(1, "strdup");
+	if (net_hostport(s, &host, &port) == -1) {
+		f->error = "bad address";
+		free(s);
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(host, port, &hints, &f->ai)) != 0) {
+		f->ai = NULL;
+		f->error = gai_strerror(error);
+		free(s);
+		return -1;
+	}
+	free(s);
+	return 0;
+}
+
+/*
+ * Read "host[:port]" per line, '#' starts a comment, and resolve them
+ * all.  Returns the array and its size in *n, or NULL if the file
+ * cannot be read or lists nobody.
+ */
+struct fetch *
+fetch_load(const char *file, int *n)
+{
+	struct fetch *f = NULL;
+	FILE *fp;
+	char line[DBLINEBUFMAX], *p, *e;
+	int i = 0;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		warn("%s", file);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "#\n")] = '\0';
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		for (e = p + strlen(p); e > p && isspace((unsigned char)e[-1]); e--)
+			;
+		*e = '\0';
+		if (*p == '\0')
+			continue;
+
+		if ((f = reallocarray(f, i + 1, sizeof(struct fetch))) == NULL)
+			err(1, "reallocarray");
+		fetch_init(&f[i++], p);
+	}
+	fclose(fp);
+	if (i == 0) {
+		warnx("%s: no host", file);
+		return NULL;
+	}
+	*n = i;
+	return f;
+}
+
+static void
+fetch_finish(struct fetch *f, int state, const char *error,
+    void (*done)(struct fetch *, void *), void *ctx)
+{
+	if (f->fd != -1)
+		close(f->fd);
+	f->fd = -1;
+	f->state = state;
+	f->error = error;
+	f->elapsed = stats_now() - f->start;
+	if (done)
+		done(f, ctx);
+}
+
+static void
+fetch_connect(struct fetch *f)
+{
+	f->start = stats_now();
+	f->len = 0;
+	f->state = FETCH_CONNECT;
+	if (f->ai == NULL) {
+		f->state = FETCH_FAIL;
+		if (f->error == NULL)
+			f->error = "unresolved";
+		return;
+	}
+	f->error = NULL;
+	if ((f->fd = socket(f->ai->ai_family, f->ai->ai_socktype,
+	    f->ai->ai_protocol)) == -1) {
+		f->state = FETCH_FAIL;
+		f->error = strerror(errno);
+		return;
+	}
+	if (fcntl(f->fd, F_SETFL, O_NONBLOCK) == -1 ||
+	    (connect(f->fd, f->ai->ai_addr, f->ai->ai_addrlen) == -1 &&
+	    errno != EINPROGRESS)) {
+		f->state = FETCH_FAIL;
+		f->error = strerror(errno);
+		close(f->fd);
+		f->fd = -1;
+		return;
+	}
+}
+
+/* descriptors fetch_run() leaves to the rest of the program */
+#define FETCH_FDRESERVE	16
+
+/*
+ * Fetch the reply of every daemon from one poll() loop with
+ * non-blocking sockets.  Nothing is sent, a daemon answers as soon as
+ * it accepts.  As many fetches run at once as there are descriptors
+ * to spare, and each fails once it took longer than timeout
+ * milliseconds, so the whole run lasts about as long as the slowest
+ * daemon.  done, if not NULL, is called as each fetch ends.
+ */
+void
+fetch_run(struct fetch *f, int n, int timeout,
+    void (*done)(struct fetch *, void *), void *ctx)
+{
+	struct pollfd *pfd;
+	u_int64_t deadline, now, wait;
+	int *idx, i, j, np, next, active, window, error;
+	socklen_t elen;
+	ssize_t r;
+
+	if ((pfd = calloc(n, sizeof(struct pollfd))) == NULL ||
+	    (idx = calloc(n, sizeof(int))) == NULL)
+		err(1, "calloc");
+	if ((window = getdtablesize() - FETCH_FDRESERVE) < 1)
+		window = 1;
+
+	next = active = 0;
+	for (;;) {
+		/* start as many as the descriptors allow */
+		for (; next < n && active < window; next++) {
+			fetch_connect(&f[next]);
+			if (f[next].state == FETCH_FAIL)
+				fetch_finish(&f[next], FETCH_FAIL,
+				    f[next].error, done, ctx);
+			else
+				active++;
+		}
+		if (active == 0)
+			break;
+
+		now = stats_now();
+		wait = (u_int64_t)timeout * 1000;
+		for (i = np = 0; i < next; i++) {
+			if (f[i].fd == -1)
+				continue;
+			deadline = f[i].start + (u_int64_t)timeout * 1000;
+			if (now >= deadline) {
+				fetch_finish(&f[i], FETCH_FAIL, "timeout",
+				    done, ctx);
+				active--;
+				continue;
+			}
+			if (deadline - now < wait)
+				wait = deadline - now;
+			pfd[np].fd = f[i].fd;
+			pfd[np].events =
+			    f[i].state == FETCH_CONNECT ? POLLOUT : POLLIN;
+			pfd[np].revents = 0;
+			idx[np++] = i;
+		}
+		if (np == 0)
+			continue;
+		if (poll(pfd, np, (wait + 999) / 1000) == -1) {
+			if (errno != EINTR)
+				err(1, "poll");
+			continue;
+		}
+
+		for (j = 0; j < np; j++) {
+			if (pfd[j].revents == 0)
+				continue;
+			i = idx[j];
+			if (f[i].state == FETCH_CONNECT) {
+				elen = sizeof(error);
+				if (getsockopt(f[i].fd, SOL_SOCKET, SO_ERROR,
+				    &error, &elen) == -1)
+					error = errno;
+				if (error) {
+					fetch_finish(&f[i], FETCH_FAIL,
+					    strerror(error), done, ctx);
+					active--;
+				} else
+					f[i].state = FETCH_READ;
+				continue;
+			}
+			r = read(f[i].fd, f[i].buf + f[i].len,
+			    sizeof(f[i].buf) - f[i].len);
+			if (r == -1 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (r == -1)
+				fetch_finish(&f[i], FETCH_FAIL,
+				    strerror(errno), done, ctx);
+			else if (r == 0)
+				fetch_finish(&f[i], FETCH_DONE, NULL,
+				    done, ctx);
+			else if ((f[i].len += r) == sizeof(f[i].buf))
+				fetch_finish(&f[i], FETCH_FAIL,
+				    "reply too long", done, ctx);
+			else
+				continue;
+			active--;
+		}
+	}
+	free(idx);
+	free(pfd);
+}
+
+/*
+ * Call cb for every "|dev|model|temp|unit|" record of a reply.  The
+ * reply is cut in place.  Returns the number of records, or -1 if the
+ * reply is malformed.
+ */
+int
+reply_parse(char *buf, size_t len,
+    void (*cb)(char *, char *, char *, char *, void *), void *ctx)
+{
+	char *field[4], *p = buf, *end = buf + len;
+	int i, nrec = 0;
+
+	while (p < end) {
+		if (*p++ != '|')
+			return -1;
+		for (i = 0; i < 4; i++) {
+			field[i] = p;
+			while (p < end && *p != '|')
+				p++;
+			if (p == end)
+				return -1;
+			*p++ = '\0';
+		}
+		cb(field[0], field[1], field[2], field[3], ctx);
+		nrec++;
+	}
+	return nrec;
+}
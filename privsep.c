@@ -17,9 +17,11 @@
  */
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,33 +29,142 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <pwd.h>
 #include <paths.h>
+#include <poll.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <endian.h>
 
 #include "hddtemp.h"
 
 int priv_fd = -1;
+
+/* seconds between two samples of [priv] on its own, 0 for none */
+int sample_interval = 0;
+
+/*
+ * The text reply of the last sample, and its generation, which moves
+ * on only when the reply changes.  It starts from the clock, so that
+ * a generation seen before a restart is not mistaken for a new one.
+ */
+static char sample_reply[HDDTEMP_REPLYMAX];
+static int sample_len = -1;
+static u_int32_t sample_gen;
+
+/*
+ * Privileged helpers.  Each one owns the disks of some controllers and
+ * reads them when told to, so that a slow bus does not hold the others
+ * up.  They are forked by [priv] with the disks open, then chroot and
+ * drop to PRIV_USER like the listener; only [priv] talks to them.  The
+ * device list they were forked with must stay the one of [priv], so
+ * they are stopped whenever it changes and started again on the next
+ * sample.
+ */
+struct priv_helper {
+	pid_t pid;
+	int fd;
+	int done;		/* answered the current sample */
+};
+
+/* a reading, index -1 ends the answer to a sample */
+struct helper_result {
+	int index;		/* in hdd_devices */
+	int temp;		/* device_temperature() */
+	int attr_slot;
+};
+
+/* number of helpers, 0 to read the disks in [priv] */
+int priv_helpers = 0;
+static struct priv_helper *helpers;	/* NULL while none runs */
+static int priv_sock = -1;		/* [priv] end, closed by the helpers */
+
+/*
+ * Every connection child (or worker) shares priv_fd, and a request
+ * must get its own answer, so the exchange is serialised by a lock in
+ * a page shared with all of them.  The pid of the holder is kept, so
+ * that the lock of a child killed in the middle can be taken over.
+ * The holder numbers its request from seq and [priv] echoes the
+ * number in the answer: one left over for a dead holder is skipped.
+ */
+struct priv_lock {
+	volatile pid_t owner;
+	u_int32_t seq;		/* of the last request */
+};
+static struct priv_lock *priv_lock;
 static volatile pid_t child_pid = -1;
 volatile sig_atomic_t gotsig_chld = 0;
+volatile sig_atomic_t gotsig_hup = 0;
+volatile sig_atomic_t gotsig_usr1 = 0;
+
+/*
+ * a request of the unprivileged side and the header of the answer.
+ * The socket keeps record boundaries, an answer is one record.
+ */
+struct priv_req {
+	int cmd;
+	u_int32_t arg;
+	u_int32_t seq;
+};
+
+struct priv_ans {
+	u_int32_t seq;		/* of the request */
+	int len;		/* of the reply after it, or a result */
+};
 
 static void sig_pass_to_chld(int);
 static void sig_chld(int);
+static void sig_hup(int);
+static void sig_usr1(int);
+static void priv_reload_database(void);
+static void priv_sample(int);
+static int  helper_start(void);
+static void helper_main(int, int, uid_t, gid_t, const char *);
+static int  helper_sample(void);
+static void helper_stop(void);
+static void helper_reap(void);
+static int  priv_render(char *, size_t);
+static int  priv_render_binary(char *, size_t, u_int32_t);
+
+static void priv_lock_enter(void);
+static void priv_lock_leave(void);
 
 static int  may_read(int, void *, size_t);
+static int  priv_read_req(int, struct priv_req *, int *);
+static void priv_answer(int, u_int32_t, char *, int);
+static int  priv_read_answer(u_int32_t, struct priv_ans *, char *, size_t);
 static void must_read(int, void *, size_t);
 static void must_write(int, void *, size_t);
 
 int
 privsep_init(void)
 {
-	int socks[2], cmd;
+	struct priv_req req;
+	int socks[2];
 	struct passwd *pw;
+	time_t next_rescan, next_sample;
+	int fd, status, reaped = 0;
+	int i, sockbuf = 2 * HDDTEMP_REPLYMAX;
 
-	/* Create sockets */
-        if (socketpair(AF_LOCAL, SOCK_STREAM, PF_UNSPEC, socks) == -1)
+	/* Create sockets, big enough for an answer in one record */
+        if (socketpair(AF_LOCAL, SOCK_SEQPACKET, PF_UNSPEC, socks) == -1)
                 err(1, "socketpair() failed");
+	for (i = 0; i < 2; i++)
+		if (setsockopt(socks[i], SOL_SOCKET, SO_SNDBUF, &sockbuf,
+		    sizeof(sockbuf)) == -1 ||
+		    setsockopt(socks[i], SOL_SOCKET, SO_RCVBUF, &sockbuf,
+		    sizeof(sockbuf)) == -1)
+			err(1, "setsockopt");
+
+	priv_lock = mmap(NULL, sizeof(struct priv_lock),
+	    PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+	if (priv_lock == MAP_FAILED)
+		err(1, "mmap");
+	priv_lock->owner = 0;
+	priv_lock->seq = 0;
 
 	if ((pw = getpwnam(PRIV_USER)) == NULL)
 		errx(1, "no such user: " PRIV_USER);
@@ -83,6 +194,10 @@ privsep_init(void)
 		if (chdir("/") != 0)
 			err(1, "unable to chdir");
 
+		/* the reload and rescan are [priv]'s, pkill must not kill us */
+		signal(SIGHUP, SIG_IGN);
+		signal(SIGUSR1, SIG_IGN);
+
 		gidset[0] = pw->pw_gid;
 		/* drop to _hddtemp */
 		if (setgroups(1, gidset) == -1)
@@ -103,37 +218,529 @@ privsep_init(void)
         }
 
 	/* Father */
-	/* Pass ALRM/TERM/HUP through to child, and accept CHLD */
+	/*
+	 * Pass ALRM/TERM through to child, reload on HUP, rescan disks
+	 * on USR1, and accept CHLD
+	 */
         signal(SIGALRM, sig_pass_to_chld);
         signal(SIGTERM, sig_pass_to_chld);
-        signal(SIGHUP,  sig_pass_to_chld);
+        signal(SIGHUP,  sig_hup);
+        signal(SIGUSR1, sig_usr1);
         signal(SIGCHLD, sig_chld);
+	/* a subscriber may hang up under a write */
+	signal(SIGPIPE, SIG_IGN);
 
         setproctitle("[priv]");
         close(socks[1]);
+	priv_sock = socks[0];
+	/* the listen sockets made so far belong to the child */
+	close_listen_socks();
 
-	while (!gotsig_chld) {
+	next_rescan = time(NULL) + disk_rescan_interval;
+	next_sample = time(NULL);
+	sample_gen = time(NULL);
+
+	for (;;) {
 		int len;
-		char buf[BUFSIZ];
-		int temp;
+		char buf[HDDTEMP_REPLYMAX];
+		struct pollfd pfd[1 + ALERT_MAXSUB];
+		int timeout = INFTIM;
+		int nfds;
+		time_t now;
+
+		/* a helper may die, only the end of the listener ends us */
+		if (gotsig_chld) {
+			gotsig_chld = 0;
+			if (waitpid(child_pid, &status, WNOHANG) == child_pid) {
+				reaped = 1;
+				break;
+			}
+			helper_reap();
+		}
 
-		if (may_read(socks[0], &cmd, sizeof(int)))
+		if (gotsig_hup) {
+			gotsig_hup = 0;
+			priv_reload_database();
+			helper_stop();
+		}
+
+		/* attach and detach disks between two requests */
+		now = time(NULL);
+		if (disk_enum && (gotsig_usr1 ||
+		    (disk_rescan_interval && now >= next_rescan))) {
+			gotsig_usr1 = 0;
+			if (disk_rescan() > 0)
+				helper_stop();
+			next_rescan = now + disk_rescan_interval;
+		}
+		if (disk_enum && disk_rescan_interval)
+			timeout = (next_rescan - now) * 1000;
+
+		/* alerts must not wait for a client to ask */
+		if (sample_interval) {
+			if (now >= next_sample) {
+				priv_sample(1);
+				next_sample = now + sample_interval;
+			}
+			if (timeout == INFTIM ||
+			    (next_sample - now) * 1000 < timeout)
+				timeout = (next_sample - now) * 1000;
+		}
+
+		/* sleep in poll(), so that a signal can wake us up */
+		pfd[0].fd = socks[0];
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		nfds = 1 + alert_pollfd(pfd + 1);
+		switch (poll(pfd, nfds, timeout)) {
+		case -1:
+			if (errno != EINTR)
+				warn("poll");
+			continue;
+		case 0:
+			continue;
+		}
+		alert_reap(pfd + 1, nfds - 1);
+		if (pfd[0].revents == 0)
+			continue;
+
+		stats_proc_update(&hdd_stats->priv);
+		if (priv_read_req(socks[0], &req, &fd))
                         break;
-		temp = smart_temperature();
 
-		if (strcmp(hdd_db->unit, "C") == 0)
-			temp = ftoc(temp);
+		if (req.cmd == PRIV_SUBSCRIBE) {
+			len = fd == -1 ? -1 : alert_subscribe(fd);
+			priv_answer(socks[0], req.seq, NULL, len);
+			continue;
+		}
+		if (fd != -1)
+			close(fd);
+
+		priv_sample(0);
+		switch (req.cmd) {
+		case PRIV_BINARY:
+			len = priv_render_binary(buf, sizeof(buf), req.arg);
+			break;
+		case PRIV_SINCE:
+			if (req.arg == sample_gen) {
+				len = snprintf(buf, sizeof(buf),
+				    "NOTMODIFIED %u\n", sample_gen);
+				break;
+			}
+			len = snprintf(buf, sizeof(buf), "GEN %u\n",
+			    sample_gen);
+			memcpy(buf + len, sample_reply, sample_len);
+			len += sample_len;
+			break;
+		case PRIV_SUMMARY:
+			len = sketch_render(buf, sizeof(buf));
+			break;
+		default:
+			memcpy(buf, sample_reply, sample_len);
+			len = sample_len;
+			break;
+		}
+		priv_answer(socks[0], req.seq, buf, len);
+	}
+
+	/*
+	 * the child cannot, it is chrooted.  After a handover the socket
+	 * is the new daemon's.
+	 */
+	if (!reaped)
+		reaped = waitpid(child_pid, &status, 0) == child_pid;
+	if (unix_listen_path && (!reaped || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != HANDOVER_EXIT))
+		unlink(unix_listen_path);
+	helper_stop();
+	_exit(0);
+}
+
+/*
+ * Re-read the database and match every device against the new entries.
+ * The answer loop is serial, so swapping the entries between two
+ * requests never exposes a half loaded database to a query.  A device
+ * keeps its old entry when the new database has none.
+ */
+static void
+priv_reload_database(void)
+{
+	if (disk_match(1) == -1)
+		fprintf(stderr, "reload %s failed, keeping old entries\n",
+		    hdd_dbfile);
+	else
+		state_save();
+}
+
+/*
+ * read every identified device and render the text reply.  Only the
+ * timed samples go into the summaries, so that they are not weighted
+ * by how often clients ask.
+ */
+static void
+priv_sample(int timed)
+{
+	struct hdd_device *dev;
+	char buf[HDDTEMP_REPLYMAX];
+	int temp, len;
+
+	/* with helpers the controllers are read at the same time */
+	if (priv_helpers == 0 || helper_sample() == -1)
+		for (dev = hdd_devices; dev; dev = dev->next)
+			if (dev->model != NULL)
+				dev->reading = dev->db ?
+				    device_temperature(dev) : INT_MAX;
+
+	for (dev = hdd_devices; dev; dev = dev->next) {
+		if (dev->model == NULL)
+			continue;
+		temp = dev->reading;
+		dev->sampled = time(NULL);
+		if (temp < 0)
+			dev->status = SAMPLE_ERR;
+		else if (temp == INT_MAX)
+			dev->status = SAMPLE_UNK;
+		else {
+			dev->status = 0;
+			dev->temp = temp;
+			if (timed)
+				sketch_add(dev, dev->sampled);
+			alert_check(dev);
+		}
+	}
+
+	/* a newly found attribute slot */
+	if (state_dirty)
+		state_save();
+
+	/* leave room for the "GEN n" line of a SINCE reply */
+	len = priv_render(buf, sizeof(buf) - 16);
+	if (len != sample_len || memcmp(buf, sample_reply, len) != 0) {
+		memcpy(sample_reply, buf, len);
+		sample_len = len;
+		sample_gen++;
+	}
+}
+
+/* fork the helpers, the disks of one controller going to the same one */
+static int
+helper_start(void)
+{
+	struct hdd_device *dev, *d;
+	struct passwd *pw;
+	char dir[PATH_MAX];
+	uid_t uid;
+	gid_t gid;
+	int socks[2], i, next = 0;
+
+	if ((pw = getpwnam(PRIV_USER)) == NULL)
+		return -1;
+	uid = pw->pw_uid;
+	gid = pw->pw_gid;
+	strlcpy(dir, pw->pw_dir, sizeof(dir));
+	endpwent();
+
+	for (dev = hdd_devices; dev; dev = dev->next) {
+		for (d = hdd_devices; d != dev; d = d->next)
+			if (disk_controller(d->dev) == disk_controller(dev->dev))
+				break;
+		dev->helper = d != dev ? d->helper : next++ % priv_helpers;
+	}
 
-		snprintf(buf, BUFSIZ - 1, "|%s|%s|%d|C|", hdd_dev, hdd_model, temp);
-		len = strlen(buf);
-		must_write(socks[0], &len, sizeof(int));
-		must_write(socks[0], buf, len);
+	if ((helpers = calloc(priv_helpers, sizeof(*helpers))) == NULL)
+		return -1;
+	for (i = 0; i < priv_helpers; i++)
+		helpers[i].pid = helpers[i].fd = -1;
+	for (i = 0; i < priv_helpers; i++) {
+		if (socketpair(AF_LOCAL, SOCK_STREAM, PF_UNSPEC, socks) == -1)
+			goto fail;
+		if ((helpers[i].pid = fork()) == -1) {
+			close(socks[0]);
+			close(socks[1]);
+			goto fail;
+		}
+		if (helpers[i].pid == 0) {
+			close(socks[0]);
+			helper_main(i, socks[1], uid, gid, dir);
+		}
+		close(socks[1]);
+		helpers[i].fd = socks[0];
 	}
+	return 0;
 
+ fail:
+	warn("helper");
+	helper_stop();
+	return -1;
+}
+
+/*
+ * read the disks of helper self on every byte from fd, chrooted to dir
+ * as the listener is.  Never returns.
+ */
+static void
+helper_main(int self, int fd, uid_t uid, gid_t gid, const char *dir)
+{
+	struct pollfd pfd[ALERT_MAXSUB];
+	struct helper_result r;
+	struct hdd_device *dev;
+	gid_t gidset[1];
+	u_char c;
+	int i, n;
+
+	/* keep its own disks and the way back to [priv], nothing else */
+	for (dev = hdd_devices; dev; dev = dev->next)
+		if (dev->helper != self && dev->fd != -1) {
+			close(dev->fd);
+			dev->fd = -1;
+		}
+	for (i = 0; i < self; i++)
+		close(helpers[i].fd);
+	close(priv_sock);
+	n = alert_pollfd(pfd);
+	for (i = 0; i < n; i++)
+		close(pfd[i].fd);
+	signal(SIGALRM, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGCHLD, SIG_DFL);
+	setproctitle("[priv %d]", self);
+
+	if (chroot(dir) != 0) {
+		fprintf(stderr, "no such directory: %s falling back to "
+		    _PATH_VAREMPTY "\n", dir);
+		if (chroot(_PATH_VAREMPTY) != 0) {
+			warn("helper %d: chroot", self);
+			_exit(1);
+		}
+	}
+	gidset[0] = gid;
+	if (chdir("/") != 0 ||
+	    setgroups(1, gidset) == -1 || setegid(gid) == -1 ||
+	    setgid(gid) == -1 || seteuid(uid) == -1 || setuid(uid) == -1) {
+		warn("helper %d", self);
+		_exit(1);
+	}
+
+	while (read(fd, &c, 1) == 1) {
+		for (i = 0, dev = hdd_devices; dev; dev = dev->next, i++) {
+			if (dev->model == NULL || dev->helper != self)
+				continue;
+			r.index = i;
+			r.temp = dev->db ? device_temperature(dev) : INT_MAX;
+			r.attr_slot = dev->attr_slot;
+			if (write(fd, &r, sizeof(r)) != sizeof(r))
+				_exit(0);
+		}
+		r.index = -1;
+		if (write(fd, &r, sizeof(r)) != sizeof(r))
+			_exit(0);
+	}
 	_exit(0);
 }
 
-/* If priv parent gets a TERM or HUP, pass it through to child instead */
+/*
+ * Have every helper read its disks, all at once, into dev->reading.
+ * Returns -1 when [priv] has to read them itself.
+ */
+static int
+helper_sample(void)
+{
+	struct pollfd pfd[PRIV_MAXHELPERS];
+	int which[PRIV_MAXHELPERS];
+	struct helper_result r;
+	struct hdd_device *dev;
+	int i, n, left;
+	u_char c = 'S';
+
+	if (helpers == NULL && helper_start() == -1)
+		return -1;
+
+	for (i = 0; i < priv_helpers; i++) {
+		helpers[i].done = 0;
+		if (write(helpers[i].fd, &c, 1) != 1)
+			goto fail;
+	}
+	for (left = priv_helpers; left > 0; ) {
+		for (i = n = 0; i < priv_helpers; i++) {
+			if (helpers[i].done)
+				continue;
+			pfd[n].fd = helpers[i].fd;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			which[n++] = i;
+		}
+		if (poll(pfd, n, INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		}
+		for (i = 0; i < n; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			if (may_read(pfd[i].fd, &r, sizeof(r)))
+				goto fail;
+			if (r.index == -1) {
+				helpers[which[i]].done = 1;
+				left--;
+				continue;
+			}
+			for (dev = hdd_devices; dev && r.index > 0;
+			    dev = dev->next)
+				r.index--;
+			if (dev == NULL)
+				continue;
+			dev->reading = r.temp;
+			/* learnt by the helper, worth keeping */
+			if (dev->attr_slot != r.attr_slot) {
+				dev->attr_slot = r.attr_slot;
+				state_dirty = 1;
+			}
+		}
+	}
+	return 0;
+
+ fail:
+	warnx("helpers failed, reading the disks in [priv]");
+	helper_stop();
+	return -1;
+}
+
+/* end every helper, they read the end of their socket */
+static void
+helper_stop(void)
+{
+	int i;
+
+	if (helpers == NULL)
+		return;
+	for (i = 0; i < priv_helpers; i++) {
+		if (helpers[i].fd != -1)
+			close(helpers[i].fd);
+		if (helpers[i].pid > 0)
+			waitpid(helpers[i].pid, NULL, 0);
+	}
+	free(helpers);
+	helpers = NULL;
+}
+
+/* a dead helper takes the others along, all start again when needed */
+static void
+helper_reap(void)
+{
+	int i;
+
+	if (helpers == NULL)
+		return;
+	for (i = 0; i < priv_helpers; i++)
+		if (helpers[i].pid > 0 &&
+		    waitpid(helpers[i].pid, NULL, WNOHANG) == helpers[i].pid) {
+			helpers[i].pid = -1;
+			helper_stop();
+			return;
+		}
+}
+
+/*
+ * "|dev|model|temp|C|" for every device, concatenated.
+ * returns the length of the reply.
+ */
+static int
+priv_render(char *buf, size_t len)
+{
+	struct hdd_device *dev;
+	char *p = buf;
+	size_t left = len;
+	int n;
+
+	buf[0] = '\0';
+	for (dev = hdd_devices; dev; dev = dev->next) {
+		if (dev->model == NULL)
+			continue;
+		if (dev->status & SAMPLE_ERR)
+			n = snprintf(p, left, "|%s|%s|ERR|*|", dev->dev,
+			    dev->model);
+		else if (dev->status & SAMPLE_UNK)
+			n = snprintf(p, left, "|%s|%s|UNK|*|", dev->dev,
+			    dev->model);
+		else
+			n = snprintf(p, left, "|%s|%s|%d|C|", dev->dev,
+			    dev->model, dev->temp);
+		if (n < 0 || (size_t)n >= left) {
+			/* drop the truncated record */
+			*p = '\0';
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+	return p - buf;
+}
+
+/*
+ * binary reply, see struct hddtemp_bin_header.  The table generation
+ * is a hash of the table itself, so it survives restarts and the
+ * table is sent only when a device or model really changed.  Room is
+ * kept for the table of the records sent; the devices which do not
+ * fit with it are left out and the reply says so.
+ */
+static int
+priv_render_binary(char *buf, size_t len, u_int32_t known_gen)
+{
+	struct hddtemp_bin_header *hdr = (struct hddtemp_bin_header *)buf;
+	struct hddtemp_bin_record *rec;
+	struct hdd_device *dev;
+	char table[HDDTEMP_REPLYMAX];
+	size_t tlen = 0, off;
+	u_int32_t gen = 2166136261U;
+	int nrec = 0, partial = 0, n;
+
+	off = sizeof(*hdr);
+	for (dev = hdd_devices; dev; dev = dev->next) {
+		if (dev->model == NULL)
+			continue;
+		n = snprintf(table + tlen, sizeof(table) - tlen, "%s%c%s%c",
+		    dev->dev, '\0', dev->model, '\0');
+		if (n < 0 || (size_t)n >= sizeof(table) - tlen ||
+		    off + sizeof(*rec) + tlen + n > len) {
+			partial = 1;
+			break;
+		}
+		tlen += n;
+
+		rec = (struct hddtemp_bin_record *)(buf + off);
+		rec->devid = htole16(nrec);
+		rec->temp = htole16(dev->status ? 0 : dev->temp * 10);
+		rec->status = htole16(dev->status);
+		rec->reserved = 0;
+		rec->stamp = htole64((u_int64_t)dev->sampled);
+		off += sizeof(*rec);
+		nrec++;
+	}
+
+	/* FNV-1a of the table */
+	for (n = 0; (size_t)n < tlen; n++)
+		gen = (gen ^ (u_int8_t)table[n]) * 16777619U;
+
+	hdr->magic[0] = 'H';
+	hdr->magic[1] = 'T';
+	hdr->version = HDDTEMP_BIN_VERSION;
+	hdr->flags = partial ? HDDTEMP_BIN_PARTIAL : 0;
+	hdr->nrec = htole16(nrec);
+	hdr->reserved = 0;
+	hdr->table_gen = htole32(gen);
+	hdr->table_len = 0;
+	if (gen != known_gen) {
+		memcpy(buf + off, table, tlen);
+		off += tlen;
+		hdr->flags |= HDDTEMP_BIN_TABLE;
+		hdr->table_len = htole32(tlen);
+	}
+	return off;
+}
+
+/* If priv parent gets a TERM, pass it through to child instead */
 static void
 sig_pass_to_chld(int sig)
 {
@@ -152,6 +759,22 @@ sig_chld(int sig)
         gotsig_chld = 1;
 }
 
+/* reload the database on the next turn of the answer loop */
+/* ARGSUSED */
+static void
+sig_hup(int sig)
+{
+        gotsig_hup = 1;
+}
+
+/* rescan disks on the next turn of the answer loop */
+/* ARGSUSED */
+static void
+sig_usr1(int sig)
+{
+        gotsig_usr1 = 1;
+}
+
 /* Read all data or return 1 for error.  */
 static int
 may_read(int fd, void *buf, size_t n)
@@ -174,6 +797,92 @@ may_read(int fd, void *buf, size_t n)
         return 0;
 }
 
+/*
+ * Read a request, and the descriptor passed along with it if any (-1
+ * otherwise).  Returns 1 for error, like may_read().
+ */
+static int
+priv_read_req(int fd, struct priv_req *req, int *passed)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+	ssize_t n;
+
+	*passed = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = req;
+	iov.iov_len = sizeof(*req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	while ((n = recvmsg(fd, &msg, 0)) == -1)
+		if (errno != EINTR && errno != EAGAIN)
+			return 1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(passed, CMSG_DATA(cmsg), sizeof(int));
+	/* a record comes whole, 0 is the end of the listener */
+	return n != sizeof(*req);
+}
+
+/* Send the answer to request seq, len bytes of buf, as one record. */
+static void
+priv_answer(int fd, u_int32_t seq, char *buf, int len)
+{
+	struct priv_ans ans;
+	struct iovec iov[2];
+
+	ans.seq = seq;
+	ans.len = len;
+	iov[0].iov_base = &ans;
+	iov[0].iov_len = sizeof(ans);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = buf ? len : 0;
+	while (writev(fd, iov, 2) == -1)
+		if (errno != EINTR && errno != EAGAIN)
+			_exit(0);
+}
+
+/*
+ * Read the answer to request seq into ans and buf, skipping those
+ * left for a dead holder of the lock.  Returns the length read into
+ * buf or -1.
+ */
+static int
+priv_read_answer(u_int32_t seq, struct priv_ans *ans, char *buf, size_t len)
+{
+	struct msghdr msg;
+	struct iovec iov[2];
+	ssize_t n;
+
+	do {
+		memset(&msg, 0, sizeof(msg));
+		iov[0].iov_base = ans;
+		iov[0].iov_len = sizeof(*ans);
+		iov[1].iov_base = buf;
+		iov[1].iov_len = len;
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		while ((n = recvmsg(priv_fd, &msg, 0)) == -1)
+			if (errno != EINTR && errno != EAGAIN)
+				return -1;
+		if (n < (ssize_t)sizeof(*ans))
+			return -1;
+	} while (ans->seq != seq);
+	if (msg.msg_flags & MSG_TRUNC)
+		return -1;
+	return n - sizeof(*ans);
+}
+
 /* Read data with the assertion that it all must come through, or
  * else abort the process.  Based on atomicio() from openssh. */
 static void
@@ -218,23 +927,97 @@ must_write(int fd, void *buf, size_t n)
         }
 }
 
+/* ask [priv], the answer goes to buf.  Returns its length or -1 */
 int
-priv_get_temperature(char *buf)
+priv_request(int cmd, u_int32_t arg, char *buf, size_t len)
 {
-	int cmd = 1;
+	struct priv_req req;
+	struct priv_ans ans;
 	int recv_len;
-	char *recv_buf;
 
-	/* wakeup */
-	must_write(priv_fd, &cmd, sizeof(int));
+	memset(&req, 0, sizeof(req));
+	req.cmd = cmd;
+	req.arg = arg;
 
-	may_read(priv_fd, &recv_len, sizeof(int));
+	priv_lock_enter();
+	req.seq = ++priv_lock->seq;
 
-	recv_buf = malloc(recv_len);
-	may_read(priv_fd, recv_buf, recv_len);
+	/* wakeup */
+	must_write(priv_fd, &req, sizeof(req));
 
-	memcpy(buf, recv_buf, recv_len);
-	free(recv_buf);
+	recv_len = priv_read_answer(req.seq, &ans, buf, len);
+	priv_lock_leave();
+	if (recv_len == -1 || ans.len != recv_len) {
+		errno = EIO;
+		return -1;
+	}
 	return recv_len;
 }
 
+/*
+ * Hand sock over to [priv], which writes the alerts to it until the
+ * client hangs up.  The caller still closes its own copy.
+ */
+int
+priv_subscribe(int sock)
+{
+	struct priv_req req;
+	struct priv_ans ans;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+	int ret = -1;
+
+	memset(&req, 0, sizeof(req));
+	req.cmd = PRIV_SUBSCRIBE;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+
+	priv_lock_enter();
+	req.seq = ++priv_lock->seq;
+	if (sendmsg(priv_fd, &msg, 0) == sizeof(req) &&
+	    priv_read_answer(req.seq, &ans, NULL, 0) == 0)
+		ret = ans.len;
+	priv_lock_leave();
+	return ret;
+}
+
+static void
+priv_lock_enter(void)
+{
+	pid_t self = getpid(), owner;
+	int spins = 0;
+
+	while (!__sync_bool_compare_and_swap(&priv_lock->owner, 0, self)) {
+		owner = priv_lock->owner;
+		/* an answer left for it is skipped by its seq */
+		if (owner != 0 && kill(owner, 0) == -1 && errno == ESRCH &&
+		    __sync_bool_compare_and_swap(&priv_lock->owner, owner,
+		    self))
+			return;
+		usleep(spins++ < 100 ? 10 : 1000);
+	}
+}
+
+static void
+priv_lock_leave(void)
+{
+	__sync_synchronize();
+	priv_lock->owner = 0;
+}
+
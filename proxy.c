@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hddtemp.h"
+
+/*
+ * Aggregating proxy.  A poller process fetches the replies of the
+ * upstream daemons concurrently every proxy_interval seconds, keeps
+ * the last good reply of each, and stores the merged records, with the
+ * device names prefixed by "upstream:", in the shared cache which the
+ * listener serves from.  An upstream which stops answering is dropped
+ * after cache_ttl seconds.
+ */
+struct proxy_upstream {
+	char last[FETCH_BUFMAX];	/* last good reply */
+	size_t lastlen;
+	time_t last_ok;
+};
+
+/* file of upstream daemons, NULL unless in proxy mode */
+char *proxy_list = NULL;
+/* seconds between two polls of the upstreams */
+int proxy_interval = 10;
+/* milliseconds allowed to a fetch */
+int fetch_timeout = 2000;
+
+static struct fetch *fetches;
+static struct proxy_upstream *upstreams;
+static int nupstreams;
+/* read end of a pipe the listener holds, at its end the poller leaves */
+static int proxy_parent = -1;
+
+/* the upstreams are resolved here, before the chroot */
+int
+proxy_load(const char *file)
+{
+	int i;
+
+	if ((fetches = fetch_load(file, &nupstreams)) == NULL)
+		return -1;
+	for (i = 0; i < nupstreams; i++)
+		if (fetches[i].ai == NULL)
+			warnx("%s: %s", fetches[i].name, fetches[i].error);
+	if ((upstreams = calloc(nupstreams,
+	    sizeof(struct proxy_upstream))) == NULL)
+		err(1, "calloc");
+	return 0;
+}
+
+struct proxy_merge {
+	char *buf;
+	size_t len;
+	size_t off;
+	const char *tag;
+};
+
+static void
+proxy_merge_record(char *dev, char *model, char *temp, char *unit, void *arg)
+{
+	struct proxy_merge *m = arg;
+	int n;
+
+	n = snprintf(m->buf + m->off, m->len - m->off, "|%s:%s|%s|%s|%s|",
+	    m->tag, dev, model, temp, unit);
+	if (n < 0 || (size_t)n >= m->len - m->off) {
+		/* drop the truncated record */
+		m->buf[m->off] = '\0';
+		return;
+	}
+	m->off += n;
+}
+
+static void
+proxy_poll(void)
+{
+	struct proxy_upstream *u;
+	struct proxy_merge m;
+	struct fetch *f = fetches;
+	struct pollfd pfd;
+	char buf[HDDTEMP_REPLYMAX], tmp[FETCH_BUFMAX];
+	time_t now;
+	int i;
+
+	for (;;) {
+		fetch_run(f, nupstreams, fetch_timeout, NULL, NULL);
+
+		now = time(NULL);
+		m.buf = buf;
+		m.len = sizeof(buf);
+		m.off = 0;
+		buf[0] = '\0';
+		for (i = 0; i < nupstreams; i++) {
+			u = &upstreams[i];
+			if (f[i].state == FETCH_DONE) {
+				memcpy(u->last, f[i].buf, f[i].len);
+				u->lastlen = f[i].len;
+				u->last_ok = now;
+			} else
+				STATS_ADD(hdd_stats->upstream_errors, 1);
+			if (u->lastlen == 0 || now - u->last_ok > cache_ttl)
+				continue;
+
+			/* parsing cuts the reply, keep the last one intact */
+			memcpy(tmp, u->last, u->lastlen);
+			m.tag = f[i].name;
+			if (reply_parse(tmp, u->lastlen, proxy_merge_record,
+			    &m) == -1)
+				STATS_ADD(hdd_stats->upstream_errors, 1);
+		}
+		/* with nothing to merge the old reply ages out of the cache */
+		cache_store(buf, m.off);
+		pfd.fd = proxy_parent;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, proxy_interval * 1000) == 1)
+			_exit(0);
+	}
+}
+
+/* start the poller, which lives as long as the listener; returns its pid */
+pid_t
+proxy_start(void)
+{
+	pid_t pid;
+	int fds[2];
+
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		close(fds[1]);
+		proxy_parent = fds[0];
+		close_listen_socks();
+		setproctitle("%s", "[proxy]");
+		proxy_poll();
+		_exit(0);
+	}
+	/* kept open until the listener exits */
+	close(fds[0]);
+	return pid;
+}
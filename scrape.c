@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hddtemp.h"
+
+/*
+ * Client mode: query every daemon of a host list at once and print the
+ * temperatures as the replies come in, then the hosts which failed or
+ * took more than half of fetch_timeout.
+ */
+
+/* file of daemons to query, NULL unless in client mode */
+char *scrape_list = NULL;
+
+static void
+scrape_record(char *dev, char *model, char *temp, char *unit, void *arg)
+{
+	const char *host = arg;
+
+	if (strcmp(unit, "*") == 0)
+		printf("%s: %s: %s: %s\n", host, dev, model, temp);
+	else
+		printf("%s: %s: %s: %s%s\n", host, dev, model, temp, unit);
+}
+
+static void
+scrape_done(struct fetch *f, void *arg)
+{
+	if (f->state != FETCH_DONE)
+		return;
+	if (reply_parse(f->buf, f->len, scrape_record, f->name) == -1) {
+		f->state = FETCH_FAIL;
+		f->error = "malformed reply";
+	}
+	fflush(stdout);
+}
+
+int
+scrape_run(const char *file)
+{
+	struct rlimit rl;
+	struct fetch *f;
+	u_int64_t start, slow;
+	int i, n, failed = 0, nslow = 0;
+
+	/* one descriptor per host in flight */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if ((f = fetch_load(file, &n)) == NULL)
+		return 1;
+
+	start = stats_now();
+	fetch_run(f, n, fetch_timeout, scrape_done, NULL);
+
+	slow = (u_int64_t)fetch_timeout * 1000 / 2;
+	for (i = 0; i < n; i++) {
+		if (f[i].state != FETCH_DONE)
+			failed++;
+		else if (f[i].elapsed > slow)
+			nslow++;
+	}
+	printf("%d hosts, %d failed, %d slow, %llu ms\n", n, failed, nslow,
+	    (unsigned long long)(stats_now() - start) / 1000);
+	for (i = 0; i < n; i++) {
+		if (f[i].state != FETCH_DONE)
+			printf("failed %s: %s\n", f[i].name, f[i].error);
+		else if (f[i].elapsed > slow)
+			printf("slow %s: %llu ms\n", f[i].name,
+			    (unsigned long long)f[i].elapsed / 1000);
+	}
+	return failed ? 1 : 0;
+}
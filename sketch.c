@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hddtemp.h"
+
+/*
+ * Per device summaries kept by [priv] as it samples.  Two moving
+ * averages weighted by the time between samples, like the load
+ * average, and the distribution of the readings over the last hour
+ * and day.  A reading is a whole degree, so the distribution is a
+ * histogram with one bucket per degree: exact, and merged by adding
+ * the counts.  Each window is a ring of SKETCH_SLOTS histograms, the
+ * oldest is cleared as time moves on, so memory stays the same however
+ * long the daemon runs.
+ */
+#define SKETCH_BUCKETS	128	/* degrees C, hotter lands in the last one */
+#define SKETCH_SLOTS	12
+
+struct sketch_ring {
+	int span;		/* seconds per slot */
+	time_t start;		/* of the newest slot */
+	int head;		/* index of the newest slot */
+	u_int32_t count[SKETCH_SLOTS][SKETCH_BUCKETS];
+};
+
+struct sketch {
+	time_t last;		/* time of the last reading */
+	double ewma[2];
+	struct sketch_ring ring[2];
+};
+
+static const int sketch_tau[2] = { 60, 900 };		/* seconds */
+static const int sketch_span[2] = { 300, 7200 };	/* 1h and 24h */
+static const char *sketch_names[2] = { "1h", "24h" };
+
+static void
+sketch_ring_advance(struct sketch_ring *r, time_t now)
+{
+	time_t n;
+
+	if (r->start == 0) {
+		r->start = now - now % r->span;
+		return;
+	}
+	if ((n = (now - r->start) / r->span) <= 0)
+		return;
+	if (n > SKETCH_SLOTS) {
+		/* the whole ring is stale */
+		memset(r->count, 0, sizeof(r->count));
+		r->start += n * r->span;
+		return;
+	}
+	for (; n > 0; n--) {
+		r->head = (r->head + 1) % SKETCH_SLOTS;
+		memset(r->count[r->head], 0, sizeof(r->count[r->head]));
+		r->start += r->span;
+	}
+}
+
+/* a new reading in C of dev taken at now */
+void
+sketch_add(struct hdd_device *dev, time_t now)
+{
+	struct sketch *s;
+	double w;
+	int i, t;
+
+	if ((s = dev->sketch) == NULL) {
+		if ((s = calloc(1, sizeof(struct sketch))) == NULL)
+			err(1, "calloc");
+		for (i = 0; i < 2; i++) {
+			s->ewma[i] = dev->temp;
+			s->ring[i].span = sketch_span[i];
+		}
+		dev->sketch = s;
+	} else if (now > s->last) {
+		for (i = 0; i < 2; i++) {
+			w = exp(-(double)(now - s->last) / sketch_tau[i]);
+			s->ewma[i] = s->ewma[i] * w + dev->temp * (1 - w);
+		}
+	}
+	s->last = now;
+
+	t = dev->temp < 0 ? 0 : dev->temp >= SKETCH_BUCKETS ?
+	    SKETCH_BUCKETS - 1 : dev->temp;
+	for (i = 0; i < 2; i++) {
+		sketch_ring_advance(&s->ring[i], now);
+		s->ring[i].count[s->ring[i].head][t]++;
+	}
+}
+
+void
+sketch_free(struct hdd_device *dev)
+{
+	free(dev->sketch);
+	dev->sketch = NULL;
+}
+
+/* smallest reading with at least q of the total at or below it */
+static int
+sketch_quantile(u_int32_t *h, u_int64_t total, double q)
+{
+	u_int64_t want, sum = 0;
+	int t;
+
+	want = ceil(q * total);
+	for (t = 0; t < SKETCH_BUCKETS - 1; t++)
+		if ((sum += h[t]) >= want)
+			break;
+	return t;
+}
+
+static int
+sketch_render_ring(char *buf, size_t len, const char *name,
+    struct sketch_ring *r, time_t now)
+{
+	u_int32_t h[SKETCH_BUCKETS];
+	u_int64_t total = 0;
+	int i, t;
+
+	sketch_ring_advance(r, now);
+	memset(h, 0, sizeof(h));
+	for (i = 0; i < SKETCH_SLOTS; i++)
+		for (t = 0; t < SKETCH_BUCKETS; t++)
+			h[t] += r->count[i][t];
+	for (t = 0; t < SKETCH_BUCKETS; t++)
+		total += h[t];
+	if (total == 0)
+		return snprintf(buf, len, " %s n 0", name);
+	return snprintf(buf, len, " %s n %llu p50 %d p95 %d p99 %d", name,
+	    (unsigned long long)total, sketch_quantile(h, total, 0.50),
+	    sketch_quantile(h, total, 0.95),
+	    sketch_quantile(h, total, 0.99));
+}
+
+/*
+ * one line per device:
+ * "dev ewma_1m t ewma_15m t 1h n N p50 t p95 t p99 t 24h n N ..."
+ * returns the length of the reply.
+ */
+int
+sketch_render(char *buf, size_t len)
+{
+	struct hdd_device *dev;
+	struct sketch *s;
+	time_t now = time(NULL);
+	size_t total = 0;
+	int i;
+
+	buf[0] = '\0';
+	for (dev = hdd_devices; dev; dev = dev->next) {
+		if ((s = dev->sketch) == NULL)
+			continue;
+		total += snprintf(buf + total, len - total,
+		    "%s ewma_1m %.1f ewma_15m %.1f", dev->dev, s->ewma[0],
+		    s->ewma[1]);
+		if (total >= len)
+			return len - 1;
+		for (i = 0; i < 2; i++) {
+			total += sketch_render_ring(buf + total, len - total,
+			    sketch_names[i], &s->ring[i], now);
+			if (total >= len)
+				return len - 1;
+		}
+		total += snprintf(buf + total, len - total, "\n");
+		if (total >= len)
+			return len - 1;
+	}
+	return total;
+}
@@ -0,0 +1,244 @@
+#!/bin/sh
+#
+# Copyright (c) 2004 Iwata <iratqq@gmail.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# Soak test.  Runs the daemon on a replayed trace (no disk needed),
+# keeps clients querying it and every interval samples STATS and the
+# processes of the daemon: resident size and open descriptors of
+# [priv] and its children, zombies, children not reaped, and the
+# service latency percentiles of the interval.  At the end a line is
+# fitted through every series; one that keeps rising is a leak and
+# the run fails.  Must run as root, like the daemon, whose messages
+# go to the log file with .err appended.
+#
+# usage: soak.sh [-c clients] [-i interval] [-L host:port] [-l log]
+#	 [-t seconds] [-x hddtemp] trace [hddtemp option ...]
+#
+
+clients=4
+interval=60
+duration=14400
+host=127.0.0.1
+port=7634
+hddtemp=./hddtemp
+log=soak.log
+
+usage() {
+	echo "usage: soak.sh [-c clients] [-i interval] [-L host:port]" \
+	    "[-l log]" >&2
+	echo "	[-t seconds] [-x hddtemp] trace [hddtemp option ...]" >&2
+	exit 1
+}
+
+while getopts c:i:L:l:t:x: ch; do
+	case $ch in
+	c)	clients=$OPTARG ;;
+	i)	interval=$OPTARG ;;
+	L)	host=${OPTARG%:*}; port=${OPTARG##*:} ;;
+	l)	log=$OPTARG ;;
+	t)	duration=$OPTARG ;;
+	x)	hddtemp=$OPTARG ;;
+	*)	usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -ge 1 ] || usage
+trace=$1
+shift
+
+name=${hddtemp##*/}
+work=$(mktemp -d /tmp/soak.XXXXXXXX) || exit 1
+loaders=
+root=
+
+cleanup() {
+	for p in $loaders; do
+		kill $p 2>/dev/null
+	done
+	[ -n "$root" ] && kill $root 2>/dev/null
+	rm -rf $work
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+query() {
+	printf '%s\n' "$1" | nc -w 5 $host $port 2>/dev/null
+}
+
+# descriptors open in a process
+fdcount() {
+	fstat -p $1 2>/dev/null | sed 1d | wc -l
+}
+
+# "procs zombies rss pid ..." of the tree under $root; the pids are
+# [priv] and its children, the long-lived processes
+tree() {
+	ps -A -o pid= -o ppid= -o stat= -o rss= | awk -v root=$root '
+	{ pid[NR] = $1; ppid[NR] = $2; stat[NR] = $3; rss[NR] = $4 }
+	END {
+		depth[root] = 0
+		do {
+			more = 0
+			for (i = 1; i <= NR; i++)
+				if (!(pid[i] in depth) && (ppid[i] in depth)) {
+					depth[pid[i]] = depth[ppid[i]] + 1
+					more = 1
+				}
+		} while (more)
+		for (i = 1; i <= NR; i++) {
+			if (!(pid[i] in depth))
+				continue
+			if (stat[i] ~ /^Z/) {
+				zombies++
+				continue
+			}
+			procs++
+			if (depth[pid[i]] <= 1) {
+				kb += rss[i]
+				pids = pids " " pid[i]
+			}
+		}
+		printf "%d %d %d%s\n", procs, zombies, kb, pids
+	}'
+}
+
+before=$(ps -A -o pid= -o comm= | awk -v n=$name '$2 == n { print $1 }')
+# daemon(0, 1) keeps stderr, not ours to hold open
+$hddtemp -d -q 200 -R "$trace" -L $host:$port "$@" </dev/null \
+    >>$log.err 2>&1 || exit 1
+sleep 2
+# the daemon()ed [priv]: new, and its parent is not one of ours
+root=$(ps -A -o pid= -o ppid= -o comm= | awk -v n=$name -v old="$before" '
+	BEGIN { split(old, o); for (i in o) seen[o[i]] = 1 }
+	{ comm[$1] = $3; ppid[$1] = $2 }
+	END {
+		for (p in comm)
+			if (comm[p] == n && !(p in seen) &&
+			    comm[ppid[p]] != n)
+				print p
+	}')
+if [ -z "$root" ] || [ $(echo $root | wc -w) -ne 1 ]; then
+	echo "soak.sh: cannot find the daemon" >&2
+	exit 1
+fi
+
+i=0
+while [ $i -lt $clients ]; do
+	(while :; do query "" >/dev/null; done) &
+	loaders="$loaders $!"
+	i=$((i + 1))
+done
+
+echo "# time rss_kb fds zombies procs unreaped listener_fds priv_fds" \
+    "p50_us p99_us errors" >$log
+query STATS >$work/stats.old
+start=$(date +%s)
+while [ $(($(date +%s) - start)) -lt $duration ]; do
+	sleep $interval
+	if ! kill -0 $root 2>/dev/null; then
+		echo "soak.sh: the daemon died" >&2
+		exit 1
+	fi
+	query STATS >$work/stats.new
+	set -- $(tree)
+	procs=$1 zombies=$2 rss=$3
+	shift 3
+	fds=0
+	for p; do
+		fds=$((fds + $(fdcount $p)))
+	done
+	# the latency buckets are cumulative, percentiles of the delta
+	awk -v t=$(($(date +%s) - start)) -v rss=$rss -v fds=$fds \
+	    -v zombies=$zombies -v procs=$procs '
+	{ file = FILENAME == ARGV[1] ? 1 : 2 }
+	$1 == "service" {
+		for (i = 7; i <= NF; i++)
+			b[file, i - 7] = $i
+		if (NF - 7 > nb)
+			nb = NF - 7
+		next
+	}
+	{ v[file, $1] = $2 }
+	function pct(q,   i, n, sum) {
+		for (i = 0; i < nb; i++)
+			n += b[2, i] - b[1, i]
+		if (n == 0)
+			return 0
+		for (i = 0; i < nb; i++) {
+			sum += b[2, i] - b[1, i]
+			if (sum >= q * n)
+				return 2 ^ i
+		}
+		return 2 ^ nb
+	}
+	END {
+		printf "%d %d %d %d %d %d %d %d %d %d %d\n", t, rss, fds,
+		    zombies, procs,
+		    v[2, "forks"] - v[2, "reaped"] - v[2, "children"],
+		    v[2, "listener_fds"], v[2, "priv_fds"],
+		    pct(0.5), pct(0.99), v[2, "errors"]
+	}' $work/stats.old $work/stats.new >>$log
+	mv $work/stats.new $work/stats.old
+done
+
+# least squares over all but the first tenth (warm up); a series fails
+# when the fitted line rises by more than both its absolute and its
+# relative limit over the run
+awk '
+BEGIN {
+	abs["rss_kb"] = 1024;	rel["rss_kb"] = 0.10
+	abs["fds"] = 2
+	abs["zombies"] = 1
+	abs["unreaped"] = 2
+	abs["listener_fds"] = 2
+	abs["priv_fds"] = 2
+	abs["p99_us"] = 1000;	rel["p99_us"] = 1.0
+}
+NR == 1 {
+	for (ncol = 2; ncol < NF; ncol++)
+		col[ncol] = $(ncol + 1)
+	next
+}
+{ line[++n] = $0 }
+END {
+	skip = int(n / 10)
+	if (n - skip < 10) {
+		print "soak.sh: too few samples" > "/dev/stderr"
+		exit 1
+	}
+	m = n - skip
+	for (c = 2; c < ncol; c++) {
+		if (!(col[c] in abs))
+			continue
+		sx = sy = sxx = sxy = 0
+		for (i = skip + 1; i <= n; i++) {
+			split(line[i], f)
+			x = i - skip
+			sx += x; sy += f[c]; sxx += x * x; sxy += x * f[c]
+		}
+		slope = (m * sxy - sx * sy) / (m * sxx - sx * sx)
+		rise = slope * (m - 1)
+		mean = sy / m
+		bad = rise > abs[col[c]] &&
+		    (!(col[c] in rel) || rise > rel[col[c]] * mean)
+		printf "%-13s mean %10.1f rise %10.1f %s\n", col[c], mean,
+		    rise, bad ? "FAIL" : "ok"
+		if (bad)
+			failed = 1
+	}
+	exit failed
+}' $log
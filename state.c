@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hddtemp.h"
+
+/*
+ * The state file keeps, per device path and serial number, the
+ * database entry the model matched and the slot of the attribute in
+ * the SMART data.  A disk found again with the same serial and model
+ * takes its entry from there, and when every disk does the database is
+ * not parsed at all.  The whole file is void once the database changes
+ * (mtime or size).  One line per device, tab separated:
+ *
+ *	dev serial model regexp dbmodel id unit warn crit slot
+ */
+#define STATE_MAGIC	"hddtemp-state 1"
+#define STATE_FIELDS	10
+
+struct state_entry {
+	struct state_entry *next;
+	char *dev;
+	char *serial;
+	char *model;
+	char *regexp;
+	char *dbmodel;
+	char *unit;
+	int id;
+	int warn;
+	int crit;
+	int slot;
+};
+
+/* path of the state file, NULL for none */
+char *state_file = NULL;
+/* set when something worth saving was learnt */
+int state_dirty = 0;
+
+static struct state_entry *state_entries;
+static long long state_mtime, state_size;
+
+static int
+state_dbstamp(long long *mtime, long long *size)
+{
+	struct stat st;
+
+	if (stat(hdd_dbfile, &st) == -1)
+		return -1;
+	*mtime = st.st_mtime;
+	*size = st.st_size;
+	return 0;
+}
+
+static void
+state_free(void)
+{
+	struct state_entry *e;
+
+	while ((e = state_entries) != NULL) {
+		state_entries = e->next;
+		/* every string lives in the block of dev */
+		free(e->dev);
+		free(e);
+	}
+}
+
+static struct state_entry *
+state_parse(char *line)
+{
+	struct state_entry *e;
+	char *field[STATE_FIELDS], *p = line;
+	const char *errstr;
+	int i, num[4];
+
+	for (i = 0; i < STATE_FIELDS; i++)
+		if ((field[i] = strsep(&p, "\t")) == NULL)
+			return NULL;
+	if (p != NULL)
+		return NULL;
+	for (i = 0; i < 4; i++) {
+		num[i] = strtonum(field[i == 0 ? 5 : i + 6], -1, 255, &errstr);
+		if (errstr)
+			return NULL;
+	}
+	if (num[0] < 1 || num[1] < 0 || num[2] < 0 || num[3] >= 30)
+		return NULL;
+
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		err(1, "calloc");
+	e->dev = line;
+	e->serial = field[1];
+	e->model = field[2];
+	e->regexp = field[3];
+	e->dbmodel = field[4];
+	e->unit = field[6];
+	e->id = num[0];
+	e->warn = num[1];
+	e->crit = num[2];
+	e->slot = num[3];
+	return e;
+}
+
+/* returns the number of entries read, or -1 */
+int
+state_load(void)
+{
+	struct state_entry *e;
+	FILE *fp;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	long long mtime, dbsize;
+	int n = 0;
+
+	if (state_file == NULL)
+		return 0;
+	if ((fp = fopen(state_file, "r")) == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		warn("%s", state_file);
+		return -1;
+	}
+	if (state_dbstamp(&state_mtime, &state_size) == -1 ||
+	    fscanf(fp, STATE_MAGIC " %lld %lld\n", &mtime, &dbsize) != 2 ||
+	    mtime != state_mtime || dbsize != state_size) {
+		/* another database, every entry may be wrong */
+		fclose(fp);
+		return 0;
+	}
+
+	while ((len = getline(&line, &size, fp)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if ((e = state_parse(line)) == NULL) {
+			warnx("%s: bad entry, ignored", state_file);
+			continue;
+		}
+		/* the entry keeps the line */
+		line = NULL;
+		size = 0;
+		e->next = state_entries;
+		state_entries = e;
+		n++;
+	}
+	free(line);
+	fclose(fp);
+	return n;
+}
+
+/* give the devices without an entry the one they had last time */
+void
+state_apply(void)
+{
+	struct hdd_device *dev;
+	struct state_entry *e;
+	long long mtime, size;
+
+	if (state_entries == NULL)
+		return;
+	if (state_dbstamp(&mtime, &size) == -1 || mtime != state_mtime ||
+	    size != state_size) {
+		state_free();
+		return;
+	}
+
+	for (dev = hdd_devices; dev; dev = dev->next) {
+		if (dev->db || dev->model == NULL || dev->serial == NULL)
+			continue;
+		for (e = state_entries; e; e = e->next) {
+			if (strcmp(e->dev, dev->dev) != 0 ||
+			    strcmp(e->serial, dev->serial) != 0 ||
+			    strcmp(e->model, dev->model) != 0)
+				continue;
+			dev->db = database_entry(e->regexp, e->dbmodel, e->id,
+			    e->unit, e->warn, e->crit);
+			dev->attr_slot = e->slot;
+			break;
+		}
+	}
+}
+
+static int
+state_printable(const char *s)
+{
+	return strpbrk(s, "\t\n") == NULL;
+}
+
+/* write the entries of every matched device, replacing the file */
+void
+state_save(void)
+{
+	struct hdd_device *dev;
+	char tmp[PATH_MAX];
+	long long mtime, size;
+	FILE *fp;
+
+	state_dirty = 0;
+	if (state_file == NULL || state_dbstamp(&mtime, &size) == -1)
+		return;
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", state_file) >=
+	    (int)sizeof(tmp))
+		return;
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		warn("%s", tmp);
+		return;
+	}
+	fprintf(fp, STATE_MAGIC " %lld %lld\n", mtime, size);
+	for (dev = hdd_devices; dev; dev = dev->next) {
+		if (dev->db == NULL || dev->serial == NULL ||
+		    *dev->serial == '\0' ||
+		    !state_printable(dev->dev) || !state_printable(dev->model) ||
+		    !state_printable(dev->serial) ||
+		    !state_printable(dev->db->model_regexp) ||
+		    !state_printable(dev->db->model))
+			continue;
+		fprintf(fp, "%s\t%s\t%s\t%s\t%s\t%d\t%s\t%d\t%d\t%d\n",
+		    dev->dev, dev->serial, dev->model, dev->db->model_regexp,
+		    dev->db->model, dev->db->id, dev->db->unit, dev->db->warn,
+		    dev->db->crit, dev->attr_slot);
+	}
+	if (fclose(fp) == EOF || rename(tmp, state_file) == -1) {
+		warn("%s", state_file);
+		unlink(tmp);
+	}
+}
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hddtemp.h"
+
+/*
+ * The counters live in an anonymous shared mapping made before the
+ * first fork, so that the [priv] process, the listener and every
+ * connection child update the same page.  Updates are atomic adds,
+ * nothing on the hot path takes a lock.  Without stats_init() (stand
+ * alone mode) a private copy is used.
+ */
+static struct hdd_stats stats_local;
+struct hdd_stats *hdd_stats = &stats_local;
+
+void
+stats_init(void)
+{
+	void *p;
+
+	p = mmap(NULL, sizeof(struct hdd_stats), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap");
+	memset(p, 0, sizeof(struct hdd_stats));
+	hdd_stats = p;
+}
+
+/* monotonic clock in microseconds */
+u_int64_t
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* bucket i counts latencies below 2^i microseconds */
+void
+stats_hist_add(struct stats_hist *h, u_int64_t usec)
+{
+	int i;
+
+	for (i = 0; i < STATS_HIST_BUCKETS - 1 && (usec >> i) != 0; i++)
+		;
+	STATS_ADD(h->count, 1);
+	STATS_ADD(h->sum_us, usec);
+	STATS_ADD(h->bucket[i], 1);
+}
+
+/* the gauges of the calling process */
+void
+stats_proc_update(struct stats_proc *p)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		p->maxrss_kb = ru.ru_maxrss;
+	p->fds = getdtablecount();
+}
+
+/* per device slot, -1 when the table is full */
+int
+stats_dev_attach(const char *dev)
+{
+	int i;
+
+	for (i = 0; i < STATS_MAXDEV; i++) {
+		if (hdd_stats->dev[i].name[0] != '\0')
+			continue;
+		memset(&hdd_stats->dev[i], 0, sizeof(hdd_stats->dev[i]));
+		strlcpy(hdd_stats->dev[i].name, dev,
+		    sizeof(hdd_stats->dev[i].name));
+		return i;
+	}
+	return -1;
+}
+
+void
+stats_dev_detach(int slot)
+{
+	if (slot >= 0 && slot < STATS_MAXDEV)
+		hdd_stats->dev[slot].name[0] = '\0';
+}
+
+static int
+stats_render_hist(char *buf, size_t len, const char *name, const char *dev,
+    struct stats_hist *h)
+{
+	int i, last, n, total;
+
+	for (last = STATS_HIST_BUCKETS - 1; last > 0 && !h->bucket[last]; last--)
+		;
+	total = snprintf(buf, len, "%s%s%s count %llu sum_us %llu log2_us",
+	    name, dev ? " " : "", dev ? dev : "",
+	    (unsigned long long)h->count, (unsigned long long)h->sum_us);
+	for (i = 0; i <= last; i++) {
+		n = snprintf(buf + total, len > (size_t)total ? len - total : 0,
+		    " %llu", (unsigned long long)h->bucket[i]);
+		total += n;
+	}
+	n = snprintf(buf + total, len > (size_t)total ? len - total : 0, "\n");
+	return total + n;
+}
+
+/*
+ * one "name value" line per counter, then the histograms.
+ * returns the length of the reply.
+ */
+int
+stats_render(char *buf, size_t len)
+{
+	struct hdd_stats *s = hdd_stats;
+	size_t total;
+	int i;
+
+	total = snprintf(buf, len,
+	    "accepts %llu\n"
+	    "accept_errors %llu\n"
+	    "forks %llu\n"
+	    "fork_errors %llu\n"
+	    "reaped %llu\n"
+	    "requests %llu\n"
+	    "stats_requests %llu\n"
+	    "binary_requests %llu\n"
+	    "errors %llu\n"
+	    "ioctl_errors %llu\n"
+	    "shed_busy %llu\n"
+	    "shed_rate %llu\n"
+	    "cache_hits %llu\n"
+	    "rejected %llu\n"
+	    "cached %llu\n"
+	    "upstream_errors %llu\n"
+	    "alerts %llu\n"
+	    "not_modified %llu\n"
+	    "children %llu\n"
+	    "listener_maxrss_kb %llu\n"
+	    "listener_fds %llu\n"
+	    "priv_maxrss_kb %llu\n"
+	    "priv_fds %llu\n",
+	    (unsigned long long)s->accepts,
+	    (unsigned long long)s->accept_errors,
+	    (unsigned long long)s->forks,
+	    (unsigned long long)s->fork_errors,
+	    (unsigned long long)s->reaped,
+	    (unsigned long long)s->requests,
+	    (unsigned long long)s->stats_requests,
+	    (unsigned long long)s->binary_requests,
+	    (unsigned long long)s->errors,
+	    (unsigned long long)s->ioctl_errors,
+	    (unsigned long long)s->shed_busy,
+	    (unsigned long long)s->shed_rate,
+	    (unsigned long long)s->cache_hits,
+	    (unsigned long long)s->rejected,
+	    (unsigned long long)s->cached,
+	    (unsigned long long)s->upstream_errors,
+	    (unsigned long long)s->alerts,
+	    (unsigned long long)s->not_modified,
+	    (unsigned long long)s->children,
+	    (unsigned long long)s->listener.maxrss_kb,
+	    (unsigned long long)s->listener.fds,
+	    (unsigned long long)s->priv.maxrss_kb,
+	    (unsigned long long)s->priv.fds);
+	if (total >= len)
+		return len - 1;
+
+	total += stats_render_hist(buf + total, len - total, "privsep_rtt",
+	    NULL, &s->privsep_rtt);
+	if (total >= len)
+		return len - 1;
+	total += stats_render_hist(buf + total, len - total, "service",
+	    NULL, &s->service);
+	if (total >= len)
+		return len - 1;
+	for (i = 0; i < STATS_MAXDEV; i++) {
+		if (s->dev[i].name[0] == '\0')
+			continue;
+		total += stats_render_hist(buf + total, len - total, "ioctl",
+		    s->dev[i].name, &s->dev[i].ioctl);
+		if (total >= len)
+			return len - 1;
+	}
+	return total;
+}
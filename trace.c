@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2004 Iwata <iratqq@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/ataio.h>
+
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hddtemp.h"
+
+/*
+ * Traces of ata_command().  Recording appends every command, its
+ * answer and how long it took to a file; replaying serves the answers
+ * from such a file, with the same delays, instead of asking a device,
+ * so that a trace taken on a host can be run anywhere.  The file is a
+ * struct trace_header, then per command a struct trace_record, the
+ * device name and the data read.  Every field is little endian.
+ */
+#define TRACE_MAGIC	"HDTR"
+#define TRACE_VERSION	1
+
+struct trace_header {
+	char magic[4];
+	u_int32_t version;
+} __packed;
+
+struct trace_record {
+	u_int32_t latency_us;
+	u_int32_t error;	/* errno of the ioctl, 0 if it succeeded */
+	u_int32_t datalen;	/* bytes of data after the name */
+	u_int16_t cylinder;
+	u_int8_t command;
+	u_int8_t features;
+	u_int8_t retsts;
+	u_int8_t status_error;	/* error register */
+	u_int8_t namelen;
+	u_int8_t reserved;
+} __packed;
+
+/* a replayed command */
+struct trace_cmd {
+	struct trace_record rec;	/* in host order */
+	char *dev;
+	u_int8_t *data;
+};
+
+/* trace file to write or replay, NULL for none */
+char *trace_file = NULL;
+int trace_replaying = 0;
+
+static FILE *trace_fp;
+static struct trace_cmd *trace_cmds;
+static int trace_ncmds;
+
+static int trace_load(void);
+
+/*
+ * Open the trace, before the first command.  A new file gets the
+ * header, the commands are appended to an existing trace.
+ */
+int
+trace_open(void)
+{
+	struct trace_header hdr;
+	struct stat st;
+
+	if (trace_file == NULL)
+		return 0;
+	if (trace_replaying)
+		return trace_load();
+
+	if ((trace_fp = fopen(trace_file, "a+")) == NULL ||
+	    fstat(fileno(trace_fp), &st) == -1) {
+		warn("%s", trace_file);
+		return -1;
+	}
+	if (st.st_size != 0) {
+		rewind(trace_fp);
+		if (fread(&hdr, sizeof(hdr), 1, trace_fp) != 1 ||
+		    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+		    letoh32(hdr.version) != TRACE_VERSION) {
+			warnx("%s: not a trace", trace_file);
+			return -1;
+		}
+		return 0;
+	}
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(TRACE_VERSION);
+	if (fwrite(&hdr, sizeof(hdr), 1, trace_fp) != 1 ||
+	    fflush(trace_fp) == EOF) {
+		warn("%s", trace_file);
+		return -1;
+	}
+	return 0;
+}
+
+/* append one command; error is the errno of the ioctl or 0 */
+void
+trace_record(struct hdd_device *dev, struct atareq *req, int error,
+    u_int64_t latency)
+{
+	struct trace_record rec;
+	FILE *fp = trace_fp;
+	size_t namelen = strlen(dev->dev);
+	int save_errno = errno;
+
+	if (fp == NULL || namelen > UINT8_MAX)
+		return;
+	memset(&rec, 0, sizeof(rec));
+	rec.latency_us = htole32(latency > UINT32_MAX ? UINT32_MAX : latency);
+	rec.error = htole32(error);
+	rec.cylinder = htole16(req->cylinder);
+	rec.command = req->command;
+	rec.features = req->features;
+	rec.retsts = req->retsts;
+	rec.status_error = req->error;
+	rec.namelen = namelen;
+	if (error == 0 && (req->flags & ATACMD_READ))
+		rec.datalen = htole32(req->datalen);
+
+	/*
+	 * flushed at once, a trace is mostly wanted after a hang.  The
+	 * disks may be read by several threads, a record is written whole.
+	 */
+	flockfile(fp);
+	if (fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+	    fwrite(dev->dev, namelen, 1, fp) != 1 ||
+	    (rec.datalen && fwrite(req->databuf, req->datalen, 1, fp) != 1) ||
+	    fflush(fp) == EOF) {
+		warn("%s, recording stopped", trace_file);
+		/* left open, another thread may be waiting for it */
+		trace_fp = NULL;
+	}
+	funlockfile(fp);
+	errno = save_errno;
+}
+
+static int
+trace_load(void)
+{
+	struct trace_header hdr;
+	struct trace_record rec;
+	struct trace_cmd *c;
+	FILE *fp;
+
+	if ((fp = fopen(trace_file, "r")) == NULL) {
+		warn("%s", trace_file);
+		return -1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    letoh32(hdr.version) != TRACE_VERSION) {
+		warnx("%s: not a trace", trace_file);
+		fclose(fp);
+		return -1;
+	}
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		trace_cmds = reallocarray(trace_cmds, trace_ncmds + 1,
+		    sizeof(struct trace_cmd));
+		if (trace_cmds == NULL)
+			err(1, "reallocarray");
+		c = &trace_cmds[trace_ncmds];
+		c->rec = rec;
+		c->rec.latency_us = letoh32(rec.latency_us);
+		c->rec.error = letoh32(rec.error);
+		c->rec.datalen = letoh32(rec.datalen);
+		c->rec.cylinder = letoh16(rec.cylinder);
+		c->dev = NULL;
+		c->data = NULL;
+		if (c->rec.datalen > 65536 ||
+		    (c->dev = calloc(1, c->rec.namelen + 1)) == NULL ||
+		    (c->data = malloc(c->rec.datalen + 1)) == NULL ||
+		    fread(c->dev, c->rec.namelen, 1, fp) != 1 ||
+		    (c->rec.datalen &&
+		    fread(c->data, c->rec.datalen, 1, fp) != 1)) {
+			warnx("%s: truncated at command %d", trace_file,
+			    trace_ncmds);
+			free(c->dev);
+			free(c->data);
+			break;
+		}
+		trace_ncmds++;
+	}
+	fclose(fp);
+	if (trace_ncmds == 0) {
+		warnx("%s: no command", trace_file);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Serve req from the next command of the trace for the same device
+ * and request, going round when the trace is exhausted.  Returns like
+ * ioctl(2).
+ */
+int
+trace_replay(struct hdd_device *dev, struct atareq *req)
+{
+	struct trace_cmd *c = NULL;
+	int i = 0, n;
+
+	for (n = 0; n < trace_ncmds; n++) {
+		i = (dev->trace_pos + n) % trace_ncmds;
+		c = &trace_cmds[i];
+		if (c->rec.command == req->command &&
+		    c->rec.features == req->features &&
+		    c->rec.cylinder == req->cylinder &&
+		    strcmp(c->dev, dev->dev) == 0)
+			break;
+	}
+	if (n == trace_ncmds) {
+		errno = ENXIO;
+		return -1;
+	}
+	dev->trace_pos = i + 1;
+
+	if (c->rec.latency_us)
+		usleep(c->rec.latency_us);
+	if (c->rec.error) {
+		errno = c->rec.error;
+		return -1;
+	}
+	req->retsts = c->rec.retsts;
+	req->error = c->rec.status_error;
+	if (c->rec.datalen && (req->flags & ATACMD_READ))
+		memcpy(req->databuf, c->data,
+		    MIN(c->rec.datalen, req->datalen));
+	return 0;
+}
+
+/* the devices of the trace, for replay without devices given by hand */
+static int
+trace_enum_list(const char *arg, disk_enum_cb cb, void *ctx)
+{
+	int i, j;
+
+	for (i = 0; i < trace_ncmds; i++) {
+		for (j = 0; j < i; j++)
+			if (strcmp(trace_cmds[j].dev, trace_cmds[i].dev) == 0)
+				break;
+		if (j == i)
+			cb(trace_cmds[i].dev, ctx);
+	}
+	return 0;
+}
+
+const struct disk_enumerator disk_enum_trace = {
+	"trace", trace_enum_list
+};